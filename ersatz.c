@@ -8,12 +8,25 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <malloc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <curl/curl.h>
 #include <libxml/HTMLparser.h>
 #include <libxml/uri.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 #include <SDL2/SDL_image.h>
+#include <fontconfig/fontconfig.h>
 #include "SDL_render.h"
 
 unsigned int fg_r = 0, fg_g = 0, fg_b = 0;       // Foreground colour
@@ -24,26 +37,68 @@ unsigned int hl_r = 0, hl_g = 0, hl_b = 255;     // Hyperlink colour
 #define FGCOLOUR ((SDL_Color) {fg_r, fg_g, fg_b, 255})
 #define BGCOLOUR ((SDL_Color) {bg_r, bg_g, bg_b, 255})
 #define HLCOLOUR ((SDL_Color) {hl_r, hl_g, hl_b, 255})
-#define SPCOLOUR ((SDL_Color) {hl_r, hl_g, hl_b, 255})
+#define SPCOLOUR ((SDL_Color) {sp_r, sp_g, sp_b, 255})
 
 #define BAR_HEIGHT 50 // The height of the URL bar
 
 typedef enum { get, post } method_t; // A type of HTTP request
+typedef enum { urlencoded, multipart } enctype_t; // How a form's fields are put in a POST body
+
+typedef enum // What kind of input a form field is
+{
+	text_field,   // A text box, which the user types into
+	secret_field, // A password box, shown as stars
+	hidden_field, // Sent with the form but never shown
+	submit_field, // A button that sends the form
+} field_kind;
 
 typedef struct _form // An HTML input form
 {
-	const char* name;
-	const char* action;
+	const char* action;         // Interned, or NULL for the current page
 	method_t method;
+	enctype_t enctype;
+	struct _form_field* fields; // Every field of the form, in document order
 } form;
 
-typedef struct _form_list // A linked list of input forms
+typedef struct _form_field // One input of a form
+{
+	struct _form_field* next; // The next field of the same form
+	form* form;
+	field_kind kind;
+	const char* name;         // Interned, or NULL if the field isn't sent
+	const char* value;        // The value attribute, or NULL
+	char* entered;            // What the user typed, or NULL if they haven't
+} form_field;
+
+typedef struct _form_list // A linked list of form fields on screen
 {
 	const struct _form_list* next;
-	const form* form;
+	form_field* field;
 	SDL_Rect box;
 } form_list;
 
+typedef enum // Who an allocation belongs to, for memory accounting
+{
+	mem_nodes,    // Simplified page nodes, their forms and their strings
+	mem_text,     // Text of text nodes
+	mem_images,   // Lazy images and their pixels
+	mem_textures, // Image textures, at four bytes a pixel
+	mem_layout,   // Hyperlink and form boxes found while rendering, and shaped text runs
+	mem_buffers,  // Download buffers and other growable buffers
+	mem_glyphs,   // The CPU renderer's glyph atlas
+	mem_history,  // History entries and their snapshots
+	mem_index,    // The history index, and pages waiting to go in it
+	mem_interned, // Strings interned for every page to share, like page urls and hosts
+	MEM_SUBSYSTEMS,
+	MEM_PER_PAGE = mem_buffers + 1, // Everything before this should be gone once a page is torn down
+} mem_subsystem;
+
+typedef struct _page_memory // What one thread has allocated in each per-page subsystem, less what it freed
+{
+	long bytes[MEM_PER_PAGE];
+	int blocks[MEM_PER_PAGE];
+} page_memory;
+
 typedef enum // A tag specifying what a node does
 {
 	text,
@@ -56,8 +111,44 @@ typedef enum // A tag specifying what a node does
 	hyperlink,
 	end_hyperlink,
 	input,
+	form_start,
 } node_type;
 
+typedef struct _cancel_token // Set from anywhere to stop a transfer at its next progress callback
+{
+	SDL_atomic_t cancelled;
+	_Bool watch_input; // If this is one, the progress callback also checks for Escape or the window closing
+} cancel_token;
+
+typedef enum // The loading state of a lazy image
+{
+	image_unloaded,
+	image_loading,
+	image_loaded,
+	image_failed,
+} image_state;
+
+#define MIP_LEVELS 4 // The most downscaled copies kept of one image
+
+typedef struct _lazy_image // An image that is only fetched and decoded when it comes near the viewport
+{
+	struct _lazy_image* next;            // Next image on the page
+	const char* src;                     // The src attribute, relative to the page
+	int width, height;                   // The width and height attributes, or 0 if not given
+	int natural_w, natural_h;            // The decoded size, or 0 if it has never been loaded
+	SDL_atomic_t state;                  // An image_state, written by the loader thread
+	SDL_Thread* loader;                  // The thread fetching the image, while loading
+	cancel_token cancel;                 // Stops the loader early, when the page goes away
+	const char* url;                     // The absolute url, in the page's strings
+	int target_w;                        // The width the loader should scale the image down to
+	SDL_Surface* decoded[MIP_LEVELS];    // Levels made by the loader, handed over when it finishes
+	int decoded_w, decoded_h;            // The full size found by the loader
+	SDL_Surface* levels[MIP_LEVELS];     // The pixels at the displayed size, then each level half the last
+	SDL_Texture* texture;                // The level currently being drawn, as a texture
+	int texture_level;
+	unsigned last_near;                  // The last frame the image was near the viewport
+} lazy_image;
+
 typedef struct _node // A node is a linked list of instructions to render a page
 {
 	const struct _node* next;
@@ -65,12 +156,255 @@ typedef struct _node // A node is a linked list of instructions to render a page
 	union
 	{
 		const char* text;
-		SDL_Surface* image;
-		const form* form;
+		lazy_image* image;
+		form* form;
+		form_field* field;
 		const void* data;
 	};
 } node;
 
+typedef struct _fetch_stats // Byte counters for a page download
+{
+	curl_off_t wire_bytes;    // Bytes of the final response received from the network, headers included, before content decoding
+	curl_off_t decoded_bytes; // Bytes handed to the parser after content decoding
+} fetch_stats;
+
+typedef struct _fetch_policy // How patient to be with a server
+{
+	long connect_timeout_ms;  // Give up connecting after this long
+	long total_timeout_ms;    // Give up on the whole transfer after this long
+	long stall_bytes_per_sec; // A transfer slower than this...
+	long stall_seconds;       // ...for this long has stalled
+	int max_attempts;         // Attempts before giving up, including the first
+	Uint32 backoff_base_ms;   // Wait about this long before the first retry, doubling each time...
+	Uint32 backoff_max_ms;    // ...up to this
+} fetch_policy;
+
+typedef struct _host_health // A circuit breaker for one host
+{
+	const char* host;   // Interned host name
+	int failures;       // Failed fetches in a row
+	Uint32 open_until;  // Until this tick, requests to the host fail straight away
+} host_health;
+
+typedef void (*fetch_reset)(void*); // Readies a download's destination for a fresh attempt
+
+typedef struct _resolved_url // A cached url resolution, keyed by the interned base and relative urls
+{
+	const char* base;
+	const char* rel;
+	const char* full;
+} resolved_url;
+
+typedef struct _resolve_cache // An open-addressed table of resolved urls
+{
+	resolved_url* entries; // Entries with a NULL base are empty
+	size_t cap;            // Always a power of two
+	size_t count;
+} resolve_cache;
+
+typedef struct _intern_table // An open-addressed set of strings, each stored once until the table is freed
+{
+	const char** strings;  // NULL where a slot is empty
+	unsigned* hashes;      // The hash of each string, so they are only ever hashed once
+	size_t cap;            // Always a power of two
+	size_t count;
+	mem_subsystem mem;     // What the table's memory is counted as
+	char* block;           // Where the next short string goes
+	size_t block_left;
+	char* blocks;          // The newest block, which starts with a pointer to the one before
+	resolve_cache resolved; // Urls resolved from the table's strings, themselves in the table
+} intern_table;
+
+typedef struct _headless_page // A page being rendered in headless mode
+{
+	const char* url;
+	const node* nodes;
+	lazy_image* images;
+	intern_table strings;
+	fetch_stats stats;
+	_Bool done; // Set by the worker once the page is ready to lay out
+} headless_page;
+
+typedef struct _buffer // A growable block of memory
+{
+	char* data;
+	size_t len;
+	size_t cap;
+} buffer;
+
+typedef struct _parsed_page // What the page builder made of a document
+{
+	const node* nodes;
+	lazy_image* images; // Every image on the page, in order
+	const char* title;  // In strings, or NULL if the page has none
+	long cache_for;     // How many seconds the response says it can be cached for, or 0 if it can't
+	intern_table strings; // The page's attribute strings and the urls resolved from them, which go with it
+} parsed_page;
+
+typedef struct _open_tag // An element the page builder is inside
+{
+	unsigned tag; // insensitive_hash() of its name
+	form* outer;  // For a form, the form around it
+} open_tag;
+
+typedef struct _page_builder // Turns libxml's SAX events into nodes, in document order, as a page is parsed
+{
+	parsed_page page;
+	const node** tail;       // Where the next node is linked in
+	lazy_image** image_tail; // Where the next image is linked in
+	open_tag* stack;         // The elements we are inside, innermost last
+	size_t depth, stack_cap;
+	buffer chars;            // Text since the last tag, joined up from however many callbacks it came in
+	int skipping;            // Inside this many scripts and styles, whose text is ignored
+	_Bool in_title;
+	form* current_form;      // The form inputs join, if any
+} page_builder;
+
+typedef struct _parse_target // Where write_to_parser() sends a download
+{
+	htmlParserCtxtPtr ctxt;
+	page_builder builder;
+	const char* url;
+	fetch_stats* stats;
+	_Bool no_store;     // The response said not to cache it, or to check with the server every time
+	long max_age;       // Seconds from the response's Cache-Control, or -1 if it didn't say
+	long age;           // How long a proxy has had the response already
+	time_t expires;     // From the Expires header, or 0 if there wasn't one
+	long header_bytes;  // Size of the headers of the latest response, not counting redirects before it
+} parse_target;
+
+typedef struct _mapped_file // A read-only file mapped into memory
+{
+	const void* data;
+	size_t size;
+} mapped_file;
+
+typedef enum // A kind of primitive the draw recorder can batch
+{
+	fill_rect,
+	outline_rect,
+} prim_kind;
+
+typedef struct _draw_prim // A coloured rectangle waiting to be drawn
+{
+	Uint32 colour; // RGBA packed into one integer, so primitives can be sorted by it
+	prim_kind kind;
+	SDL_Rect rect;
+} draw_prim;
+
+typedef struct _draw_copy // A texture waiting to be copied to the screen
+{
+	SDL_Texture* texture;
+	SDL_Rect rect;
+	_Bool owned; // If this is one, the texture is destroyed once it has been drawn
+} draw_copy;
+
+#define GLYPH_ATLAS_SIZE 1024 // The glyph atlas is this many pixels square
+#define GLYPH_SLOTS 4096      // Glyphs the atlas can index at once, a power of two
+
+typedef struct _glyph // A glyph's coverage, kept in the glyph atlas
+{
+	TTF_Font* font; // NULL where a slot is empty
+	uint32_t c;
+	int x, y, w, h; // Where its coverage is in the atlas, or no size if it draws nothing
+} glyph;
+
+typedef struct _glyph_atlas // Every glyph the CPU renderer has drawn, packed in rows into one coverage plane
+{
+	uint8_t* pixels;               // GLYPH_ATLAS_SIZE square, one byte a pixel
+	int shelf_x, shelf_y, shelf_h; // Where the next glyph goes, and how tall the row being filled is
+	glyph* slots;                  // GLYPH_SLOTS of them, open-addressed by font and character
+	size_t count;
+} glyph_atlas;
+
+typedef struct _glyph_draw // A glyph waiting to be blended into the window surface
+{
+	const glyph* g;
+	int x, y;
+	SDL_Color colour;
+} glyph_draw;
+
+typedef struct _find_state // The page's text for find-in-page, and what is being looked for in it
+{
+	char* text;          // Every text node of the page one after another, lowercased, each ending in a null byte
+	size_t len;
+	const node** nodes;  // The text nodes, in page order...
+	size_t* starts;      // ...and where each one's text starts
+	size_t node_count;
+	char* needle;        // What is being looked for, lowercased, or NULL when nothing is
+	size_t needle_len;
+	size_t* matches;     // Where it was found, in order
+	size_t match_count;
+	size_t current;      // The match last jumped to
+	int current_y;       // Set by layout to where the current match is, from the top of the page
+} find_state;
+
+typedef struct _text_hits // The matches inside one text node
+{
+	const size_t* at; // Offsets into the find text
+	size_t base;      // The find text offset of the node's first byte
+	size_t count;
+	size_t first;     // The index of at[0] among all the matches
+} text_hits;
+
+typedef struct _shown_frame // What the window surface last showed, so the CPU renderer can tell what needs drawing
+{
+	const node* page;
+	int scroll, width, height;
+	_Bool valid; // Zero when anything else might have changed
+} shown_frame;
+
+typedef struct _draw_list // Everything drawn since the last flush
+{
+	draw_prim* prims;
+	size_t prim_count, prim_cap;
+	draw_copy* copies;
+	size_t copy_count, copy_cap;
+	glyph_draw* glyphs; // Only used by the CPU renderer
+	size_t glyph_count, glyph_cap;
+	SDL_Rect* batch; // Scratch space for submitting a run of rectangles at once
+	size_t batch_cap;
+} draw_list;
+
+typedef enum // Whether a line of text may break at a character
+{
+	no_break,
+	space_break,   // The line may end here, and the space is dropped
+	newline_break, // The line must end here
+} break_kind;
+
+typedef struct _shaped_char // One character of a shaped text run
+{
+	uint32_t offset; // Where the character starts in the text
+	uint8_t cells;   // Columns it takes up: 0 for combining marks, 2 for wide characters
+	uint8_t face;    // 0 for the run's own font, otherwise one more than the fallback face that draws it
+	uint8_t brk;     // A break_kind
+} shaped_char;
+
+typedef struct _text_run // A string shaped once in one font, and reused by every frame that draws it
+{
+	const char* text; // The node's text, which the run is keyed by along with the font
+	TTF_Font* font;
+	int char_width, char_height; // The size of one column in the font
+	size_t count;                // Characters, not counting the sentinel
+	shaped_char chars[];         // Followed by a sentinel whose offset is the length of the text
+} text_run;
+
+typedef struct _run_cache // An open-addressed table of text runs for the current page
+{
+	text_run** runs; // NULL where a slot is empty
+	size_t cap;      // Always a power of two
+	size_t count;
+} run_cache;
+
+typedef struct _fallback_face // A system font that stands in for characters the page fonts lack
+{
+	char* file;
+	int index;
+	TTF_Font* font; // Opened at the page text size
+} fallback_face;
+
 typedef struct _hlink // A hyperlink with a url and a position
 {
 	SDL_Rect box;
@@ -83,24 +417,196 @@ typedef struct _hlink_list // A list of hyperlinks
 	hlink link;
 } hlink_list;
 
+typedef struct _request // A page to fetch, and what to send with it
+{
+	const char* url;       // Interned, or own_url's data
+	buffer own_url;        // A form submission's url, which outlives the page the form was on
+	method_t method;
+	buffer body;           // The encoded fields of a POST
+	char content_type[96]; // The Content-Type header line for the body
+} request;
+
+typedef struct _page_load // A page being fetched on another thread while the window carries on
+{
+	const request* req;
+	fetch_stats* stats;
+	parsed_page page;
+	_Bool loaded;
+	char* final_url;
+	char error[CURL_ERROR_SIZE];
+	page_memory memory; // What building the page allocated
+	SDL_atomic_t done;
+} page_load;
+
+typedef struct _snapshot // A compressed picture of a page's viewport, kept so going back shows something straight away
+{
+	int w, h;          // Size in pixels
+	int scroll_offset; // How far the page was scrolled
+	buffer qoi;        // The pixels encoded as QOI, or empty once spilled to disk
+	long spill_at;     // Where the encoded pixels start in spill_file, once memory got tight
+	size_t size;       // Length of the encoded pixels, wherever they are
+} snapshot;
+
+#define PAGE_CACHE_VERSION 3 // Bump whenever the layout of a page cache file or the meaning of its nodes changes
+#define NO_STRING UINT32_MAX // A string offset standing for NULL
+
+typedef struct _page_header // The start of a page cache file, followed by the nodes and then the string pool
+{
+	char magic[4];        // "ERPC"
+	uint32_t version;     // PAGE_CACHE_VERSION
+	uint32_t node_count;
+	uint32_t image_count;
+	uint32_t form_count;
+	uint32_t field_count;
+	uint32_t url;         // Offset of the requested url in the pool
+	uint32_t final_url;   // Offset of the url the page ended up at
+	uint32_t title;       // Offset of the title, or NO_STRING
+	uint32_t pool_size;
+	int64_t expires;      // The page is stale after this time, in seconds since the epoch
+} page_header;
+
+typedef struct _packed_node // A node as stored in a page cache file
+{
+	uint32_t type;
+	uint32_t a, b, c; // String offsets or numbers, depending on the type
+} packed_node;
+
+typedef struct _cached_page // A page loaded from the page cache
+{
+	mapped_file file;      // The cache file, which the page's strings point into
+	node* nodes;           // Every node, then every form, field and image, in one allocation
+	size_t count;
+	const char* final_url; // Interned
+	const char* title;     // Points into the file
+} cached_page;
+
 typedef struct _url_list // A list of URLs
 {
 	const struct _url_list *next;
 	const char* full_url;
+	snapshot* snap; // What the page looked like when we left it, or NULL
 } url_list;
 
+typedef struct _history_record // The start of each page in the history log, followed by its url, title and words
+{
+	char magic[4];    // "ERHI"
+	uint32_t size;    // Bytes in the record after this header
+	uint32_t check;   // string_hash() of those bytes, so a record cut short by a crash can be spotted
+	uint32_t visited; // When the page was loaded, in seconds since the epoch
+} history_record;
+
+typedef struct _history_doc // A visited page in the history index
+{
+	const char* url;   // Both owned by the index
+	const char* title; // NULL if the page had none
+	uint32_t visited;
+	uint32_t check;    // Its record's check, so a page that hasn't changed isn't added again
+	uint32_t length;   // How many words it has, counting repeats
+	_Bool live;        // Zero once its url has been visited again
+	long offset;       // Where its record started in the log as read at startup, or -1 if added since
+} history_doc;
+
+typedef struct _history_term // A word in the history index, and the pages it is on
+{
+	char* term;
+	uint32_t hash;
+	uint32_t count;    // How many pages it is on, including ones since visited again
+	uint32_t last_doc; // The last page in the postings, which the next is stored relative to
+	uint8_t* postings; // For each page, the gap from the one before and how often the word appears, as varints
+	uint32_t len, cap;
+} history_term;
+
+typedef struct _history_job // A visited page waiting to be indexed
+{
+	struct _history_job* next;
+	char* url;
+	char* title; // NULL if the page had none
+	char* text;  // The page's find text, with the nodes separated by null bytes
+	size_t len;
+	uint32_t visited;
+} history_job;
+
+typedef struct _history_index // The words on every page ever visited, searchable from the url bar
+{
+	SDL_mutex* lock;        // Guards the queue and the index, so pages can be added while the main thread searches
+	SDL_cond* wake;         // Signalled when a job is queued, or it is time to stop
+	SDL_Thread* thread;
+	history_job* jobs;      // Oldest first
+	history_job** last_job;
+	_Bool ready;            // The log has been read in
+	_Bool stopping;
+	history_doc* docs;
+	uint32_t doc_count, doc_cap;
+	uint32_t live_count;
+	uint64_t live_length;   // Total length of the live pages, for the average
+	history_term* terms;    // Open addressing, a power of two in size
+	uint32_t term_count, term_cap;
+	uint32_t* urls;         // Page numbers plus one, hashed by url, for the latest visit to each
+	uint32_t url_cap;
+	FILE* log;              // Appended to by the indexer, or NULL if the log can't be written
+} history_index;
+
+typedef struct _history_hit // A page found by a history search
+{
+	uint32_t doc;
+	float score;
+} history_hit;
+
+typedef struct _history_cursor // Where a search has got to in one word's postings
+{
+	const uint8_t* p;
+	const uint8_t* end;
+	uint32_t doc, tf; // The page it is on, and how often the word appears there
+	uint32_t count;   // How many pages the word is on, so the rarest can lead
+	float idf;        // How much a page having the word counts for
+} history_cursor;
+
+typedef enum // The loops that take input events, so a replay can hand each event to the one that took it
+{
+	event_main,    // The main loop, once a frame
+	event_load,    // load_page_async(), while a page loads
+	event_prompt,  // text_input()
+	event_history, // history_view()
+	EVENT_SITES,
+} event_site;
+
+#define SESSION_VERSION 1 // Bump whenever the layout of a session file changes
+
+typedef struct _session_header // The start of a --record file, followed by the events
+{
+	char magic[4];         // "ERIR"
+	uint32_t version;      // SESSION_VERSION
+	uint32_t event_size;   // sizeof(SDL_Event), which has to match to replay
+	int32_t width, height; // The window size at the start
+} session_header;
+
+typedef struct _recorded_event // An input event in a --record file
+{
+	uint32_t site; // The event_site that took it
+	uint32_t idle; // How many times that loop found nothing since the last event, which for the main loop is frames drawn
+	uint32_t ms;   // When it came, in milliseconds since the start, for anyone reading the file
+	uint32_t pad;
+	SDL_Event event;
+} recorded_event;
+
 static const char* text_input(const char*);
 static void draw_bar(void);
-static FILE* url_to_file(const char*);
+static CURL* new_curl_handle(void);
+static _Bool url_to_page(CURL*, const request*, fetch_stats*, cancel_token*, parsed_page*, char*);
+static _Bool load_page(CURL*, const request*, fetch_stats*, cancel_token*, parsed_page*, char**, char*);
 static void dealloc_nodes(const node*);
+static void free_parsed_page(parsed_page*);
 static void dealloc_forms(const form_list*);
 static _Noreturn void throw_error(const char*, ...);
 static _Noreturn void handle_error_signal(int);
 static void bind_error_signals(void);
-static const node* simplify_html(htmlNodePtr, const node*);
 static unsigned insensitive_hash(const char*);
 static const node* alloc_node(node_type, const void*, const node*);
-static void print_simplified_html(const node*);
+static htmlParserCtxtPtr create_page_parser(page_builder*, const char*, int);
+static parsed_page finish_builder(page_builder*);
+static int field_kind_of(const char*);
+static const char* field_value(const form_field*);
+static void print_simplified_html(const node*, FILE*);
 static void render_simplified_html(const node*);
 
 // The size and position of the back button.
@@ -114,11 +620,99 @@ static _Bool should_rerender_bar = 1;
 // Linked list of previous urls
 static const url_list* history;
 
-// Current url as string
+// Words on visited pages, kept on disk so history can be searched by typing ? and some words into the url bar
+static history_index hindex;
+
+// If this is zero, visited pages aren't indexed or written to disk
+static _Bool history_indexing = 1;
+
+// Words longer than this aren't indexed, as they are almost always ids or hashes
+#define MAX_TERM 32
+
+// How many results a history search shows
+#define HISTORY_RESULTS 30
+
+// History logs with more pages than this are rewritten on startup if most of their pages have been visited again
+#define HISTORY_COMPACT_MIN 256
+
+// Snapshots past this many encoded bytes, counting from the newest, are spilled to disk
+#define SNAPSHOT_MEMORY_CAP (16 << 20)
+
+// Size of a thumbnail in the history view
+#define THUMB_WIDTH 192
+#define THUMB_HEIGHT 144
+
+// Where to scroll the next page to, if it is being restored from history
+static int restore_scroll = 0;
+
+// Spilled snapshots, all in one temporary file so they share a descriptor. It goes once none are left in it.
+static FILE* spill_file = NULL;
+static int spilled_snapshots = 0;
+
+// How many pages back in the history the page being loaded is, or 0 if it is a new one
+static int going_back = 0;
+
+// Simplified pages are cached for this many seconds, or not at all if it is 0
+static int page_cache_age = 600;
+
+// The current page, if it came from the page cache
+static cached_page current_cached;
+
+// A picture of the page being gone back to, drawn while it loads
+static SDL_Texture* backdrop = NULL;
+
+// Current url as string. Once a page has loaded this is always interned.
 static const char* current_url = NULL;
 
+// The url of the page on screen, which its images are relative to. While the next page loads, current_url is already its url.
+static const char* page_url = NULL;
+
+// Strings shared beyond any one page. They are shared by all threads, and are guarded by intern_lock.
+static intern_table interned = {.mem = mem_interned};
+static SDL_SpinLock intern_lock;
+
+// The strings of the page on screen, which go when it does
+static intern_table page_strings;
+
+// Interned strings are packed into blocks of this size, a pointer to the block before included
+#define INTERN_BLOCK_SIZE 65536
+
 static CURL* curl_handle;
 
+// Counters for the current page
+static fetch_stats page_stats;
+
+// Cancels the page load in progress
+static cancel_token page_cancel;
+
+// Fetch policies for pages and for images. Images matter less, so get fewer retries.
+static const fetch_policy page_policy =
+{
+	.connect_timeout_ms = 10000, .total_timeout_ms = 60000,
+	.stall_bytes_per_sec = 1, .stall_seconds = 15,
+	.max_attempts = 4, .backoff_base_ms = 250, .backoff_max_ms = 4000,
+};
+// A POST might have gone through before the connection broke, so it is never sent twice.
+static const fetch_policy submit_policy =
+{
+	.connect_timeout_ms = 10000, .total_timeout_ms = 60000,
+	.stall_bytes_per_sec = 1, .stall_seconds = 15,
+	.max_attempts = 1,
+};
+static const fetch_policy image_policy =
+{
+	.connect_timeout_ms = 10000, .total_timeout_ms = 30000,
+	.stall_bytes_per_sec = 1, .stall_seconds = 15,
+	.max_attempts = 2, .backoff_base_ms = 500, .backoff_max_ms = 500,
+};
+
+// Circuit breakers for recently used hosts, guarded by host_lock
+#define HOST_SLOTS 64
+#define HOST_MAX_FAILURES 3      // Failed fetches in a row before a host is left alone...
+#define HOST_COOLDOWN_MS 30000   // ...for this long
+static host_health hosts[HOST_SLOTS];
+static SDL_SpinLock host_lock;
+
 // Title for window manager
 static const char* window_title = "";
 
@@ -132,6 +726,19 @@ static int scroll_offset = 0;
 static SDL_Renderer* renderer;
 static SDL_Window* window;
 
+// Primitives and copies for the frame being drawn
+static draw_list draws;
+
+// If this is one, there is no GPU: the software renderer draws into the window surface, only damaged parts
+// of it are redrawn and presented, and text is blended straight into it from the glyph atlas
+static _Bool cpu_render = 0;
+static _Bool cpu_glyphs = 0; // Set if the window surface is a format blend_span() understands
+static glyph_atlas atlas;
+static shown_frame shown;
+
+// Find-in-page for the current page
+static find_state finder;
+
 // Colour to render text in
 static SDL_Color text_color;
 // Font to render text in
@@ -143,6 +750,34 @@ static TTF_Font* menu_font;
 static TTF_Font* bold_font;
 static TTF_Font* italic_font;
 
+// Point size of the page text, and of the bar and other menus
+#define TEXT_FONT_SIZE 15
+#define MENU_FONT_SIZE 22
+
+// The font files, mapped once and shared between sizes
+static mapped_file regular_font_file;
+static mapped_file bold_font_file;
+static mapped_file italic_font_file;
+
+// Shaped text runs for the current page, keyed by the address of the text
+static run_cache text_runs;
+
+// System fonts found through fontconfig for characters the page fonts lack
+#define MAX_FALLBACK_FACES 32
+static fallback_face fallback_faces[MAX_FALLBACK_FACES];
+static int fallback_face_count = 0;
+
+// The fallback face last used in each 128-character block of Unicode, plus one, so one lookup covers a script
+static uint8_t block_faces[0x110000 >> 7];
+
+// Characters no system font has, so fontconfig isn't asked about them again
+#define MISSING_SLOTS 256
+static uint32_t missing_chars[MISSING_SLOTS];
+
+// If this is one, startup milestones are timed and printed
+static _Bool startup_trace = 0;
+static Uint64 startup_time;
+
 // All hyperlinks on current page
 static hlink_list* hyperlinks = NULL;
 
@@ -157,6 +792,58 @@ static int window_height = 480;
 // All input forms on a page
 static const form_list* forms = NULL;
 
+// All images on the current page
+static lazy_image* page_images = NULL;
+
+// Images are loaded within this many pixels of the viewport, and freed beyond four times it
+static int image_load_distance = 1000;
+#define IMAGE_UNLOAD_DISTANCE (image_load_distance * 4)
+
+// At most this many images are fetched at once
+#define MAX_IMAGE_LOADS 4
+static int image_loads = 0;
+
+// Counts rendered frames, so we can tell which images were near the viewport this frame
+static unsigned frame_count = 0;
+
+// If this is one, render_simplified_html() only lays the page out, drawing nothing
+static _Bool measuring = 0;
+
+// Headless mode renders a list of pages to files instead of opening a window
+static _Bool headless = 0;
+static _Bool headless_png = 0;
+static _Bool headless_text = 0;
+static const char* headless_dir = ".";
+static int headless_jobs = 0;
+static headless_page* headless_pages = NULL;
+static int headless_count = 0;
+static SDL_atomic_t headless_next;
+static SDL_mutex* headless_lock;
+static SDL_cond* headless_ready;
+
+// If this is set, the page in this file is converted over and over to measure throughput
+static const char* bench_file = NULL;
+
+// If this is one, the page cache is checked instead of opening a window
+static _Bool cache_check = 0;
+
+// Input events are written to record_file as they are handled, or read from replay_file instead of the user
+static const char* record_file = NULL;
+static const char* replay_file = NULL;
+static FILE* recording = NULL;
+static mapped_file replaying;
+static size_t replay_next = 0;  // The next event to hand out
+static uint32_t replay_idle = 0; // How many more times its loop finds nothing before it
+
+// Frame and page load times, in milliseconds, for the report at the end of a replay
+static float* frame_times = NULL;
+static size_t frame_time_count = 0;
+static float* load_times = NULL;
+static size_t load_time_count = 0;
+
+// Pages taller than this are cut off in headless PNGs
+#define HEADLESS_MAX_HEIGHT 32768
+
 // Possible cursors to set
 static SDL_Cursor* default_cursor;
 static SDL_Cursor* loading_cursor;
@@ -181,22 +868,143 @@ static int progress_bar(void* ptr, double total_down, double down, double total_
 	return 0;
 }
 
+// Live bytes and blocks for each subsystem
+static SDL_atomic_t mem_bytes[MEM_SUBSYSTEMS];
+static SDL_atomic_t mem_blocks[MEM_SUBSYSTEMS];
+static const char* const mem_names[MEM_SUBSYSTEMS] =
+	{"nodes", "text", "images", "textures", "layout", "buffers", "glyphs", "history", "index", "interned"};
+
+// Set by SIGUSR1, and the counters are printed next frame
+static volatile sig_atomic_t memory_dump_requested = 0;
+
+// If this is one, the counters are drawn over the page
+static _Bool memory_overlay = 0;
+
+// The same counters, for just this thread, so a new page's memory can be told apart from the old page's
+static _Thread_local page_memory thread_memory;
+
+/*
+	count_memory() adds to a subsystem's counters. Negative numbers take away.
+*/
+static void count_memory(mem_subsystem s, long bytes, int blocks)
+{
+	SDL_AtomicAdd(&mem_bytes[s], bytes);
+	SDL_AtomicAdd(&mem_blocks[s], blocks);
+	if (s >= MEM_PER_PAGE) return;
+	thread_memory.bytes[s] += bytes;
+	thread_memory.blocks[s] += blocks;
+}
+
+/*
+	memory_since() turns a copy of thread_memory taken earlier into what this thread has allocated since.
+*/
+static void memory_since(page_memory* m)
+{
+	for (int s = 0; s < MEM_PER_PAGE; ++s)
+	{
+		m->bytes[s] = thread_memory.bytes[s] - m->bytes[s];
+		m->blocks[s] = thread_memory.blocks[s] - m->blocks[s];
+	}
+}
+
+/*
+	tracked() counts a block from malloc() and friends against a subsystem, and returns it.
+	The size comes from the allocator, so anything freed with free() can be counted, whoever allocated it.
+*/
+static void* tracked(mem_subsystem s, void* ptr)
+{
+	if (ptr) count_memory(s, malloc_usable_size(ptr), 1);
+	return ptr;
+}
+
+/*
+	untracked() stops counting a block, before it is freed or handed to another subsystem.
+*/
+static void* untracked(mem_subsystem s, void* ptr)
+{
+	if (ptr) count_memory(s, -(long)malloc_usable_size(ptr), -1);
+	return ptr;
+}
+
+/*
+	track_malloc(), track_calloc(), track_realloc(), track_strdup() and track_free() are
+	the usual functions, counting against a subsystem.
+*/
+static void* track_malloc(mem_subsystem s, size_t size)
+{
+	return tracked(s, malloc(size));
+}
+
+static void* track_calloc(mem_subsystem s, size_t count, size_t size)
+{
+	return tracked(s, calloc(count, size));
+}
+
+static void* track_realloc(mem_subsystem s, void* ptr, size_t size)
+{
+	untracked(s, ptr);
+	return tracked(s, realloc(ptr, size));
+}
+
+static char* track_strdup(mem_subsystem s, const char* str)
+{
+	return tracked(s, strdup(str));
+}
+
+static void track_free(mem_subsystem s, const void* ptr)
+{
+	free(untracked(s, (void*)ptr));
+}
+
+/*
+	dump_memory() prints the counters for every subsystem.
+*/
+static void dump_memory(FILE* out)
+{
+	fputs("Memory in use:\n", out);
+	for (int s = 0; s < MEM_SUBSYSTEMS; ++s)
+		fprintf(out, "  %-9s %10d bytes in %6d blocks\n", mem_names[s], SDL_AtomicGet(&mem_bytes[s]), SDL_AtomicGet(&mem_blocks[s]));
+}
+
+/*
+	request_memory_dump() is the SIGUSR1 handler. Printing isn't safe in a handler, so it just sets a flag.
+*/
+static void request_memory_dump(int sig)
+{
+	(void)sig;
+	memory_dump_requested = 1;
+}
+
+/*
+	check_page_memory() makes sure a page left nothing behind once it was torn down.
+	The next page is usually built before the last one goes, so what it took is given, and only the rest counts.
+	It only runs in debug builds.
+*/
+static void check_page_memory(const page_memory* next_page)
+{
+#ifdef ERSATZ_DEBUG
+	for (int s = 0; s < MEM_PER_PAGE; ++s)
+	{
+		if (SDL_AtomicGet(&mem_bytes[s]) == next_page->bytes[s] && SDL_AtomicGet(&mem_blocks[s]) == next_page->blocks[s]) continue;
+		dump_memory(stderr);
+		throw_error("The last page leaked %s memory", mem_names[s]);
+	}
+#else
+	(void)next_page;
+#endif
+}
+
 /*
 	dealloc_forms() takes a list of forms and deallocates them all
 */
 static void dealloc_forms(const form_list* l)
 {
-	if (l)
+	// The forms themselves belong to the page's nodes.
+	while (l)
 	{
-		if (l->form)
-		{
-			// TODO
-			//if (l->form->action) free((void*)l->form->action);
-			//if (l->form->method) free((void*)l->form->method);
-			//free((void*)l->form);
-		}
-		dealloc_forms(l->next);
-		free((void*)l);
+		const form_list* next = l->next;
+		track_free(mem_layout, l);
+		l = next;
 	}
 }
 
@@ -205,9 +1013,12 @@ static void dealloc_forms(const form_list* l)
 */
 static void dealloc_links(const hlink_list* l)
 {
-	if (!l) return;
-	dealloc_links(l->next);
-	free((void*)l);
+	while (l)
+	{
+		const hlink_list* next = l->next;
+		track_free(mem_layout, l);
+		l = next;
+	}
 }
 
 /*
@@ -247,7 +1058,7 @@ static int is_on_screen(int y1, int y2)
 */
 static void add_hyperlink(const char* url, int x, int y, int w, int h)
 {
-	hlink_list* l = malloc(sizeof *l);
+	hlink_list* l = track_malloc(mem_layout, sizeof *l);
 	l->link = (hlink) {.url=url, .box=(SDL_Rect){.x=x,.y=y,.w=w,.h=h}};
 	l->next = hyperlinks;
 	hyperlinks = l;
@@ -271,129 +1082,1386 @@ static char* add_urls(const char* url1, const char* url2)
 }
 
 /*
-	render_text() draws text to the screen in a specified font. 'render' specifies whether to actually draw or simulate drawing.
-	This implements a home-grown organic text wrapping algorithm.
+	string_hash() hashes a string case-sensitively, the same way insensitive_hash() does.
 */
-static void render_text(const char* static_text, SDL_Renderer* renderer, TTF_Font* font, bool render)
+static unsigned string_hash(const char* str, size_t len)
 {
-	// This algorithm writes wrapped text to the window and updates the plotter variables accordingly.
-	// It assumes that the provided font is monospaced, for simplicity and performance reasons.
-	size_t bytes = strlen(static_text) + 2;
-	char* text = malloc(bytes); // We allocate a buffer for our own string...
-	char* start = text;
-	memcpy(text + 1, static_text, bytes - 1); // ...and move the string there
-	text[0] = ' ';
-	int char_width, char_height;
-	TTF_SizeUTF8(font, "a", &char_width, &char_height); // Calculate the width and height of one character
-	int linebreak_pos = -1;
-	bool more_lines;
-	bool first_iteration = true;
-	do {
-		more_lines = false;
-		int wrap_chars = (window_width - plotter_x - MARGIN_WIDTH) / char_width; // Calculate how many pixels we have to work with
-		int len = 0;
-		for (; text[len]; ++len) // Iterate over the string until we find place for a linebreak
-		{
-			if (linebreak_pos >= 0 && len > wrap_chars) break;
-			if (isspace(text[len])) linebreak_pos = len; // Whitespace is a valid position for an inserted linebreak
-			if (text[len] == '\n') goto linebreak; // Newlines are always linebreaks
-		}
-		len = strlen(text);
-		if (wrap_chars < len && linebreak_pos >= 0)
-		{
-linebreak:
-			text[linebreak_pos] = '\0'; // Null-terminate our string where we want the line to end
-			len = linebreak_pos;
-			more_lines = true;
-		}
-		text += first_iteration;
-		len -= first_iteration;
-		linebreak_pos -= first_iteration;
-		if (render)
-		{
-			SDL_Surface* surface = TTF_RenderUTF8_Blended(font, text, text_color); // Render our line - only up to the null byte
-			SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
-			SDL_Rect rect = {plotter_x, plotter_y, char_width * len, char_height};
-			SDL_RenderCopy(renderer, texture, NULL, &rect);
-			SDL_DestroyTexture(texture);
-			SDL_FreeSurface(surface);
-		}
-		if (more_lines) // Update the plotter variables...
-		{
-			plotter_y += char_height; // ...for the next iteration...
-			plotter_x = MARGIN_WIDTH;
-			text += linebreak_pos + 1;
-		}
-		else plotter_x += char_width * len; // ...or not
-		first_iteration = false;
-	} while (more_lines);
-	free(start);
+	unsigned hash = 0;
+	for (size_t i = 0; i < len; ++i)
+		hash = (unsigned char)str[i] + ((long)hash << 6) + ((long)hash << 16) - hash;
+	return hash;
 }
 
 /*
-	print_tag_hashes() is a debugging function to print the hashes for the html tags so i can put them in a switch.
+	new_intern_block() starts a block of size bytes for t's strings, linked to the ones before so they can be freed.
+	It returns where the strings go.
 */
-static void print_tag_hashes(void)
+static char* new_intern_block(intern_table* t, size_t size)
 {
-	char* arr[] = {"TR", "TD", "TH", "TITLE", "P", "A", "I", "B", "BR", "SCRIPT", "STYLE", "EM", "H1", "H2", "H3", "H4", "H5", "H6", "IMG", "FORM", "INPUT"};
-	for (size_t i = 0; i < sizeof(arr) / sizeof(arr[0]); ++i)
-		printf("#define %s_TAG %u\n", arr[i], insensitive_hash(arr[i]));
+	char* block = track_malloc(t->mem, sizeof(char*) + size);
+	memcpy(block, &t->blocks, sizeof(char*));
+	t->blocks = block;
+	return block + sizeof(char*);
 }
 
 /*
-	url_to_file() downloads to url to a temporary file, returning a file handle.
-	There is no caching.
-	There are no parallel downloads.
+	store_interned() copies a string into t's blocks, where it stays until the table is freed.
 */
-static FILE* url_to_file(const char* url)
+static const char* store_interned(intern_table* t, const char* str, size_t len)
 {
-	// Writes data from a URL to a file.
-	fprintf(stderr, "Downloading %s... ", url);
-	FILE* out_file = tmpfile(); // Make a temporary file
-	if (!out_file) throw_error("Cannot load URL %s", url);
-	curl_easy_setopt(curl_handle, CURLOPT_URL, url);				// Set the URL
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, out_file); // Set output file
-	int err = 0, retries = 0;
-	do {
-		err = curl_easy_perform(curl_handle);
-		if (retries++ == 5) throw_error((char*)curl_easy_strerror(err));
-	} while (err);
-	rewind(out_file);
-	fputs("Done.\n", stderr);
-	return out_file;
+	char* copy;
+	if (len + 1 > INTERN_BLOCK_SIZE / 4)
+	{
+		// Long strings get their own block rather than wasting the end of one.
+		copy = new_intern_block(t, len + 1);
+	}
+	else
+	{
+		if (len + 1 > t->block_left)
+		{
+			t->block = new_intern_block(t, INTERN_BLOCK_SIZE - sizeof(char*));
+			t->block_left = INTERN_BLOCK_SIZE - sizeof(char*);
+		}
+		copy = t->block;
+		t->block += len + 1;
+		t->block_left -= len + 1;
+	}
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
 }
 
 /*
-	parse_html_file() reads a file pointer and parses it with libxml
+	grow_interned() doubles the size of an intern table. Stored hashes mean no string is hashed again.
 */
-static htmlDocPtr parse_html_file(FILE* fp, const char* url)
+static void grow_interned(intern_table* t)
 {
-	xmlSubstituteEntitiesDefault(true);
-	htmlDocPtr doc = htmlReadFd(fileno(fp), url, NULL, HTML_PARSE_NOBLANKS | HTML_PARSE_NONET);
-	if (!doc) throw_error("Cannot parse file");
-	return doc;
+	size_t cap = t->cap ? t->cap * 2 : 1024;
+	const char** strings = track_calloc(t->mem, cap, sizeof *strings);
+	unsigned* hashes = track_malloc(t->mem, cap * sizeof *hashes);
+	for (size_t i = 0; i < t->cap; ++i)
+	{
+		if (!t->strings[i]) continue;
+		size_t j = t->hashes[i] & (cap - 1);
+		while (strings[j]) j = (j + 1) & (cap - 1);
+		strings[j] = t->strings[i];
+		hashes[j] = t->hashes[i];
+	}
+	track_free(t->mem, t->strings);
+	track_free(t->mem, t->hashes);
+	t->strings = strings;
+	t->hashes = hashes;
+	t->cap = cap;
 }
 
 /*
-	simplify_html() converts libxml's ast into my own. The second argument specifies the next node.
+	intern_in() returns t's one stored copy of the first len bytes of str, storing it if it is new.
+	The pointer lasts as long as the table, and can be kept and compared like a handle until then.
+	The caller has the table to itself, or holds its lock.
 */
-static const node* simplify_html(htmlNodePtr ptr, const node* head)
+static const char* intern_in(intern_table* t, const char* str, size_t len)
 {
-	// ptr is the LAST node, and we iterate BACKWARDS, so our linked list is forwards
-	static const char* form_action;
-	static method_t form_method;
-	for (; ptr ; ptr = ptr->prev)
+	unsigned hash = string_hash(str, len);
+	if ((t->count + 1) * 4 > t->cap * 3) grow_interned(t);
+	size_t i = hash & (t->cap - 1);
+	for (; t->strings[i]; i = (i + 1) & (t->cap - 1))
 	{
-		switch (ptr->type)
-		{
-			case XML_ELEMENT_NODE:
-				{
-					size_t tag_hash = insensitive_hash((char*)ptr->name);
-					switch(tag_hash)
-					{
-#define TR_TAG 7609598
-#define TD_TAG 7609584
-#define TH_TAG 7609588
+		const char* s = t->strings[i];
+		if (t->hashes[i] == hash && !strncmp(s, str, len) && !s[len]) return s;
+	}
+	const char* s = store_interned(t, str, len);
+	t->strings[i] = s;
+	t->hashes[i] = hash;
+	t->count++;
+	return s;
+}
+
+/*
+	free_intern_table() frees a table, its strings and its resolved urls, leaving it empty and ready to use again.
+*/
+static void free_intern_table(intern_table* t)
+{
+	for (char* block = t->blocks, *next; block; block = next)
+	{
+		memcpy(&next, block, sizeof next);
+		track_free(t->mem, block);
+	}
+	track_free(t->mem, t->strings);
+	track_free(t->mem, t->hashes);
+	track_free(t->mem, t->resolved.entries);
+	*t = (intern_table){.mem = t->mem};
+}
+
+/*
+	intern_n() returns the one stored copy of the first len bytes of str that every page and thread shares.
+	These are never freed, so it is only for strings that outlive a page, like page urls. A page's own strings go
+	in its table with intern_in() instead.
+*/
+static const char* intern_n(const char* str, size_t len)
+{
+	SDL_AtomicLock(&intern_lock);
+	const char* s = intern_in(&interned, str, len);
+	SDL_AtomicUnlock(&intern_lock);
+	return s;
+}
+
+/*
+	intern() interns a whole string. NULL stays NULL.
+*/
+static const char* intern(const char* str)
+{
+	return str ? intern_n(str, strlen(str)) : NULL;
+}
+
+/*
+	resolve_slot() finds where a (base, rel) pair is or should go in a resolve cache.
+*/
+static resolved_url* resolve_slot(resolve_cache* c, const char* base, const char* rel)
+{
+	size_t i = ((uintptr_t)base * 31 + (uintptr_t)rel) >> 3;
+	for (;; i++)
+	{
+		resolved_url* e = &c->entries[i & (c->cap - 1)];
+		if (!e->base || (e->base == base && e->rel == rel)) return e;
+	}
+}
+
+/*
+	resolve_url() turns a link relative to a page into an absolute url, kept in the page's table t.
+	base must be interned and rel must last as long as t. Each unique pair is only resolved by curl once,
+	after that it comes from t's cache.
+*/
+static const char* resolve_url(intern_table* t, const char* base, const char* rel)
+{
+	if (!rel) return base;
+	if (!base) return rel;
+	resolve_cache* c = &t->resolved;
+	if ((c->count + 1) * 4 > c->cap * 3)
+	{
+		resolve_cache old = *c;
+		c->cap = old.cap ? old.cap * 2 : 256;
+		c->entries = track_calloc(t->mem, c->cap, sizeof *c->entries);
+		for (size_t i = 0; i < old.cap; ++i)
+			if (old.entries[i].base) *resolve_slot(c, old.entries[i].base, old.entries[i].rel) = old.entries[i];
+		track_free(t->mem, old.entries);
+	}
+	resolved_url* e = resolve_slot(c, base, rel);
+	if (e->full) return e->full;
+
+	// Not seen before, so let curl work it out.
+	char* joined = add_urls(base, rel);
+	*e = (resolved_url){.base = base, .rel = rel, .full = joined ? intern_in(t, joined, strlen(joined)) : rel};
+	c->count++;
+	curl_free(joined);
+	return e->full;
+}
+
+/*
+	draw_prim_rect() records a filled or outlined rectangle to be drawn at the next flush.
+*/
+static void draw_prim_rect(prim_kind kind, SDL_Color c, SDL_Rect rect)
+{
+	if (draws.prim_count == draws.prim_cap)
+	{
+		draws.prim_cap = draws.prim_cap ? draws.prim_cap * 2 : 64;
+		draws.prims = realloc(draws.prims, draws.prim_cap * sizeof *draws.prims);
+	}
+	Uint32 colour = (Uint32)c.r << 24 | (Uint32)c.g << 16 | (Uint32)c.b << 8 | c.a;
+	draws.prims[draws.prim_count++] = (draw_prim){.colour = colour, .kind = kind, .rect = rect};
+}
+
+/*
+	draw_hline() records a horizontal line, which is just a rectangle one pixel high.
+*/
+static void draw_hline(SDL_Color c, int x1, int x2, int y)
+{
+	draw_prim_rect(fill_rect, c, (SDL_Rect){.x = x1, .y = y, .w = x2 - x1 + 1, .h = 1});
+}
+
+/*
+	draw_texture() records a texture copy. If owned is set, the texture is destroyed after it is drawn.
+*/
+static void draw_texture(SDL_Texture* texture, SDL_Rect rect, _Bool owned)
+{
+	if (draws.copy_count == draws.copy_cap)
+	{
+		draws.copy_cap = draws.copy_cap ? draws.copy_cap * 2 : 64;
+		draws.copies = realloc(draws.copies, draws.copy_cap * sizeof *draws.copies);
+	}
+	draws.copies[draws.copy_count++] = (draw_copy){.texture = texture, .rect = rect, .owned = owned};
+}
+
+/*
+	draw_glyph() records a glyph from the atlas to be blended into the window surface at the next flush.
+*/
+static void draw_glyph(const glyph* g, int x, int y, SDL_Color colour)
+{
+	if (draws.glyph_count == draws.glyph_cap)
+	{
+		draws.glyph_cap = draws.glyph_cap ? draws.glyph_cap * 2 : 256;
+		draws.glyphs = realloc(draws.glyphs, draws.glyph_cap * sizeof *draws.glyphs);
+	}
+	draws.glyphs[draws.glyph_count++] = (glyph_draw){.g = g, .x = x, .y = y, .colour = colour};
+}
+
+/*
+	blend_span() blends a colour into a row of XRGB pixels, by how much of each pixel is covered.
+	With SSE2, four pixels go at once, widened to 16 bits a channel: dst * (255 - a) + colour * a
+	can't overflow that, and dividing by 255 is done with shifts.
+*/
+static void blend_span(Uint32* dst, const uint8_t* cover, int n, SDL_Color c)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i colour = _mm_set_epi16(255, c.r, c.g, c.b, 255, c.r, c.g, c.b);
+	for (; i + 4 <= n; i += 4)
+	{
+		uint32_t a4;
+		memcpy(&a4, cover + i, 4);
+		if (!a4) continue; // Most of a glyph's box is empty
+		__m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a4), zero);
+		a = _mm_unpacklo_epi16(a, a);
+		__m128i a_lo = _mm_unpacklo_epi32(a, a); // Coverage of the first two pixels, once per channel
+		__m128i a_hi = _mm_unpackhi_epi32(a, a); // ...and of the last two
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i lo = _mm_unpacklo_epi8(d, zero);
+		__m128i hi = _mm_unpackhi_epi8(d, zero);
+		lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, _mm_sub_epi16(full, a_lo)), _mm_mullo_epi16(colour, a_lo)), half);
+		hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, _mm_sub_epi16(full, a_hi)), _mm_mullo_epi16(colour, a_hi)), half);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < n; ++i)
+	{
+		unsigned a = cover[i];
+		if (!a) continue;
+		Uint32 d = dst[i], out = 0xFF000000;
+		const unsigned src[3] = {c.b, c.g, c.r};
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			unsigned t = (d >> (ch * 8) & 255) * (255 - a) + src[ch] * a + 128;
+			out |= ((t + (t >> 8)) >> 8) << (ch * 8);
+		}
+		dst[i] = out;
+	}
+}
+
+/*
+	blend_glyphs() blends every recorded glyph into the window surface, inside the renderer's clip rectangle.
+*/
+static void blend_glyphs(void)
+{
+	SDL_Surface* s = SDL_GetWindowSurface(window);
+	SDL_Rect clip, bounds = {.x = 0, .y = 0, .w = s ? s->w : 0, .h = s ? s->h : 0};
+	SDL_RenderGetClipRect(renderer, &clip);
+	if (SDL_RectEmpty(&clip)) clip = bounds;
+	if (s && SDL_IntersectRect(&clip, &bounds, &clip))
+	{
+		if (SDL_MUSTLOCK(s)) SDL_LockSurface(s);
+		for (size_t i = 0; i < draws.glyph_count; ++i)
+		{
+			const glyph_draw* d = &draws.glyphs[i];
+			SDL_Rect box = {.x = d->x, .y = d->y, .w = d->g->w, .h = d->g->h}, seen;
+			if (!SDL_IntersectRect(&box, &clip, &seen)) continue;
+			const uint8_t* cover = atlas.pixels + (size_t)(d->g->y + seen.y - d->y) * GLYPH_ATLAS_SIZE + d->g->x + seen.x - d->x;
+			Uint8* row = (Uint8*)s->pixels + (size_t)seen.y * s->pitch + seen.x * 4;
+			for (int y = 0; y < seen.h; ++y)
+				blend_span((Uint32*)(row + (size_t)y * s->pitch), cover + (size_t)y * GLYPH_ATLAS_SIZE, seen.w, d->colour);
+		}
+		if (SDL_MUSTLOCK(s)) SDL_UnlockSurface(s);
+	}
+	draws.glyph_count = 0;
+}
+
+/*
+	same_prim_state() tells whether two primitives can go to the renderer in the same call.
+*/
+static _Bool same_prim_state(const draw_prim* p, const draw_prim* q)
+{
+	return p->colour == q->colour && p->kind == q->kind;
+}
+
+/*
+	flush_draws() submits everything recorded since the last flush.
+	Primitives are drawn in the order they were recorded, as later ones can cover earlier ones, but each run
+	of them in the same colour and kind goes to the renderer in one call. Then the textures are copied on top,
+	also in the order they were recorded.
+*/
+static void flush_draws(void)
+{
+	if (draws.batch_cap < draws.prim_count)
+	{
+		draws.batch_cap = draws.prim_count;
+		draws.batch = realloc(draws.batch, draws.batch_cap * sizeof *draws.batch);
+	}
+	for (size_t i = 0; i < draws.prim_count;)
+	{
+		const draw_prim* first = &draws.prims[i];
+		size_t n = 0;
+		for (; i < draws.prim_count && same_prim_state(first, &draws.prims[i]); ++i)
+			draws.batch[n++] = draws.prims[i].rect;
+		Uint32 c = first->colour;
+		SDL_SetRenderDrawColor(renderer, c >> 24, c >> 16 & 255, c >> 8 & 255, c & 255);
+		if (first->kind == fill_rect) SDL_RenderFillRects(renderer, draws.batch, n);
+		else SDL_RenderDrawRects(renderer, draws.batch, n);
+	}
+	for (size_t i = 0; i < draws.copy_count; ++i)
+	{
+		SDL_RenderCopy(renderer, draws.copies[i].texture, NULL, &draws.copies[i].rect);
+		if (draws.copies[i].owned) SDL_DestroyTexture(draws.copies[i].texture);
+	}
+	draws.prim_count = 0;
+	draws.copy_count = 0;
+	if (draws.glyph_count)
+	{
+		// Glyphs go straight into the surface, so whatever the renderer has queued must land first.
+		SDL_RenderFlush(renderer);
+		blend_glyphs();
+	}
+}
+
+/*
+	reset_atlas() empties the glyph atlas, for the first time or once it is full.
+	Anything already recorded is drawn first, as it points into the atlas.
+*/
+static void reset_atlas(void)
+{
+	flush_draws();
+	if (!atlas.pixels)
+	{
+		atlas.pixels = track_malloc(mem_glyphs, GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE);
+		atlas.slots = track_malloc(mem_glyphs, GLYPH_SLOTS * sizeof *atlas.slots);
+	}
+	memset(atlas.slots, 0, GLYPH_SLOTS * sizeof *atlas.slots);
+	atlas.count = 0;
+	atlas.shelf_x = atlas.shelf_y = atlas.shelf_h = 0;
+}
+
+/*
+	get_glyph() finds a glyph in the atlas, rasterising it with SDL_ttf the first time it is drawn.
+	Only its coverage is kept, so one copy serves every colour. It returns NULL if the glyph draws nothing.
+*/
+static const glyph* get_glyph(TTF_Font* font, uint32_t c)
+{
+	if (!atlas.pixels) reset_atlas();
+	glyph* g;
+	for (size_t i = ((uintptr_t)font >> 4) * 31 + c;; i++)
+	{
+		g = &atlas.slots[i & (GLYPH_SLOTS - 1)];
+		if (!g->font) break;
+		if (g->font == font && g->c == c) return g->w ? g : NULL;
+	}
+	SDL_Surface* s = TTF_RenderGlyph32_Blended(font, c, (SDL_Color){255, 255, 255, 255});
+	int w = s ? s->w : 0, h = s ? s->h : 0;
+	if (w > GLYPH_ATLAS_SIZE || h > GLYPH_ATLAS_SIZE) w = h = 0;
+	if (atlas.shelf_x + w > GLYPH_ATLAS_SIZE)
+	{
+		// Start a new row
+		atlas.shelf_y += atlas.shelf_h;
+		atlas.shelf_x = atlas.shelf_h = 0;
+	}
+	if ((atlas.count + 1) * 4 > GLYPH_SLOTS * 3 || atlas.shelf_y + h > GLYPH_ATLAS_SIZE)
+	{
+		SDL_FreeSurface(s);
+		reset_atlas();
+		return get_glyph(font, c);
+	}
+	*g = (glyph){.font = font, .c = c, .x = atlas.shelf_x, .y = atlas.shelf_y, .w = w, .h = h};
+	atlas.count++;
+	if (w && h)
+	{
+		// Blended glyphs are ARGB, so the coverage is the top byte.
+		if (SDL_MUSTLOCK(s)) SDL_LockSurface(s);
+		for (int y = 0; y < h; ++y)
+		{
+			const Uint32* src = (const Uint32*)((const Uint8*)s->pixels + (size_t)y * s->pitch);
+			uint8_t* dst = atlas.pixels + (size_t)(g->y + y) * GLYPH_ATLAS_SIZE + g->x;
+			for (int x = 0; x < w; ++x) dst[x] = src[x] >> 24;
+		}
+		if (SDL_MUSTLOCK(s)) SDL_UnlockSurface(s);
+		atlas.shelf_x += w;
+		if (h > atlas.shelf_h) atlas.shelf_h = h;
+	}
+	SDL_FreeSurface(s);
+	return w && h ? g : NULL;
+}
+
+/*
+	decode_utf8() reads one character from a UTF-8 string, and how many bytes it took.
+	Anything malformed is read as one byte of U+FFFD.
+*/
+static uint32_t decode_utf8(const char* str, size_t* len)
+{
+	const unsigned char* s = (const unsigned char*)str;
+	*len = 1;
+	if (s[0] < 0x80) return s[0];
+	int extra = s[0] >= 0xF0 ? 3 : s[0] >= 0xE0 ? 2 : s[0] >= 0xC0 ? 1 : 0;
+	if (!extra || s[0] > 0xF4) return 0xFFFD;
+	uint32_t c = s[0] & (0x3F >> extra);
+	for (int i = 1; i <= extra; ++i)
+	{
+		if ((s[i] & 0xC0) != 0x80) return 0xFFFD; // This also stops at the null byte
+		c = c << 6 | (s[i] & 0x3F);
+	}
+	static const uint32_t least[] = {0, 0x80, 0x800, 0x10000};
+	if (c < least[extra] || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0xFFFD;
+	*len = extra + 1;
+	return c;
+}
+
+/*
+	find_system_font() asks fontconfig for a font with a character in it, preferring monospaced ones,
+	and opens it as a fallback face. It returns the face's index, or -1 if there is no such font.
+*/
+static int find_system_font(uint32_t c)
+{
+	FcPattern* pattern = FcPatternCreate();
+	FcCharSet* chars = FcCharSetCreate();
+	FcCharSetAddChar(chars, c);
+	FcPatternAddCharSet(pattern, FC_CHARSET, chars);
+	FcPatternAddString(pattern, FC_FAMILY, (const FcChar8*)"monospace");
+	FcPatternAddBool(pattern, FC_SCALABLE, FcTrue);
+	FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+	FcDefaultSubstitute(pattern);
+	FcResult result;
+	FcPattern* match = FcFontMatch(NULL, pattern, &result);
+	FcPatternDestroy(pattern);
+	FcCharSetDestroy(chars);
+
+	// The best match doesn't have to have the character, so check.
+	int face = -1;
+	FcChar8* file;
+	FcCharSet* has;
+	int index = 0;
+	if (!match || FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch
+		|| FcPatternGetCharSet(match, FC_CHARSET, 0, &has) != FcResultMatch || !FcCharSetHasChar(has, c))
+		goto done;
+	FcPatternGetInteger(match, FC_INDEX, 0, &index);
+	for (int i = 0; i < fallback_face_count; ++i)
+	{
+		if (fallback_faces[i].index == index && !strcmp(fallback_faces[i].file, (char*)file))
+		{
+			if (TTF_GlyphIsProvided32(fallback_faces[i].font, c)) face = i;
+			goto done;
+		}
+	}
+	if (fallback_face_count == MAX_FALLBACK_FACES) goto done;
+	TTF_Font* font = TTF_OpenFontIndex((char*)file, TEXT_FONT_SIZE, index);
+	if (!font) goto done;
+	if (!TTF_GlyphIsProvided32(font, c))
+	{
+		TTF_CloseFont(font);
+		goto done;
+	}
+	face = fallback_face_count++;
+	fallback_faces[face] = (fallback_face){.file = strdup((char*)file), .index = index, .font = font};
+done:
+	if (match) FcPatternDestroy(match);
+	return face;
+}
+
+/*
+	fallback_for() finds a fallback face for a character the page fonts lack, or returns -1 if nothing has it.
+	Faces are remembered by block, so the first character of a script pays for the fontconfig lookup and
+	the rest of it doesn't.
+*/
+static int fallback_for(uint32_t c)
+{
+	int face = block_faces[c >> 7] - 1;
+	if (face >= 0 && TTF_GlyphIsProvided32(fallback_faces[face].font, c)) return face;
+	for (face = 0; face < fallback_face_count; ++face)
+		if (TTF_GlyphIsProvided32(fallback_faces[face].font, c)) goto found;
+	if (missing_chars[c % MISSING_SLOTS] == c) return -1;
+	face = find_system_font(c);
+	if (face < 0)
+	{
+		missing_chars[c % MISSING_SLOTS] = c;
+		return -1;
+	}
+found:
+	block_faces[c >> 7] = face + 1;
+	return face;
+}
+
+/*
+	close_fallback_fonts() closes every fallback face. It goes before TTF_Quit().
+*/
+static void close_fallback_fonts(void)
+{
+	for (int i = 0; i < fallback_face_count; ++i)
+	{
+		TTF_CloseFont(fallback_faces[i].font);
+		free(fallback_faces[i].file);
+	}
+	fallback_face_count = 0;
+	memset(block_faces, 0, sizeof block_faces);
+}
+
+/*
+	char_cells() works out how many columns a character takes up, from how far the font that draws it advances.
+	Our fonts are monospaced, so anything much wider than a column, such as CJK or emoji, gets two.
+*/
+static int char_cells(TTF_Font* font, uint32_t c, int char_width)
+{
+	if (c < 0x80) return 1;
+	int advance;
+	if (TTF_GlyphMetrics32(font, c, NULL, NULL, NULL, NULL, &advance)) return 1;
+	if (!advance) return 0;
+	return advance > char_width * 3 / 2 ? 2 : 1;
+}
+
+/*
+	run_slot() finds where the run for some text in a font is or should go in the run cache.
+*/
+static text_run** run_slot(const char* text, const TTF_Font* font)
+{
+	size_t i = ((uintptr_t)text * 31 + (uintptr_t)font) >> 3;
+	for (;; i++)
+	{
+		text_run** slot = &text_runs.runs[i & (text_runs.cap - 1)];
+		if (!*slot || ((*slot)->text == text && (*slot)->font == font)) return slot;
+	}
+}
+
+/*
+	shape_text() returns the shaped run for a node's text in a font, shaping it the first time it is asked for.
+	Shaping decodes the text, picks a font for every character and measures it, and marks where lines may break.
+	Runs are keyed by the text's address, so they only last as long as the page: clear_text_runs() drops them.
+*/
+static const text_run* shape_text(const char* text, TTF_Font* font)
+{
+	if ((text_runs.count + 1) * 4 > text_runs.cap * 3)
+	{
+		run_cache old = text_runs;
+		text_runs.cap = old.cap ? old.cap * 2 : 256;
+		text_runs.runs = track_calloc(mem_layout, text_runs.cap, sizeof *text_runs.runs);
+		for (size_t i = 0; i < old.cap; ++i)
+			if (old.runs[i]) *run_slot(old.runs[i]->text, old.runs[i]->font) = old.runs[i];
+		track_free(mem_layout, old.runs);
+	}
+	text_run** slot = run_slot(text, font);
+	if (*slot) return *slot;
+
+	size_t length = strlen(text);
+	text_run* run = track_malloc(mem_layout, sizeof *run + (length + 1) * sizeof *run->chars);
+	*run = (text_run){.text = text, .font = font};
+	TTF_SizeUTF8(font, "a", &run->char_width, &run->char_height);
+	for (size_t i = 0, len; i < length; i += len)
+	{
+		uint32_t c = decode_utf8(text + i, &len);
+		shaped_char* sc = &run->chars[run->count++];
+		*sc = (shaped_char){.offset = i, .brk = c == '\n' ? newline_break : c < 0x80 && isspace(c) ? space_break : no_break};
+		TTF_Font* drawn_by = font;
+		if (c >= 0x80 && !TTF_GlyphIsProvided32(font, c))
+		{
+			int face = fallback_for(c);
+			if (face >= 0)
+			{
+				sc->face = face + 1;
+				drawn_by = fallback_faces[face].font;
+			}
+		}
+		sc->cells = char_cells(drawn_by, c, run->char_width);
+	}
+	run->chars[run->count].offset = length;
+	run = track_realloc(mem_layout, run, sizeof *run + (run->count + 1) * sizeof *run->chars);
+	*slot = run;
+	text_runs.count++;
+	return run;
+}
+
+/*
+	clear_text_runs() frees every shaped run. It goes whenever the text they belong to does.
+*/
+static void clear_text_runs(void)
+{
+	for (size_t i = 0; i < text_runs.cap; ++i) track_free(mem_layout, text_runs.runs[i]);
+	track_free(mem_layout, text_runs.runs);
+	text_runs = (run_cache){0};
+}
+
+/*
+	draw_text_line() draws characters start to end of a run at the plotter.
+	Each stretch drawn by one font is rendered in one go, and squeezed into its columns so the grid lines up.
+	The CPU renderer draws from the glyph atlas instead, which saves making a texture for every line.
+*/
+static void draw_text_line(const text_run* run, size_t start, size_t end)
+{
+	if (cpu_glyphs)
+	{
+		// Glyph by glyph from the atlas, with combining marks over the character before them.
+		int x = plotter_x, last_x = x;
+		for (size_t i = start; i < end; ++i)
+		{
+			const shaped_char* sc = &run->chars[i];
+			size_t len;
+			uint32_t c = decode_utf8(run->text + sc->offset, &len);
+			if (sc->cells) last_x = x;
+			x += run->char_width * sc->cells;
+			if (c == ' ') continue;
+			const glyph* g = get_glyph(sc->face ? fallback_faces[sc->face - 1].font : run->font, c);
+			if (g) draw_glyph(g, last_x, plotter_y, text_color);
+		}
+		return;
+	}
+	static char* scratch = NULL;
+	static size_t scratch_cap = 0;
+	int x = plotter_x;
+	for (size_t i = start, j; i < end; i = j)
+	{
+		int cells = 0;
+		for (j = i; j < end && run->chars[j].face == run->chars[i].face; ++j) cells += run->chars[j].cells;
+		if (!cells) continue;
+		size_t bytes = run->chars[j].offset - run->chars[i].offset;
+		if (scratch_cap <= bytes)
+		{
+			scratch_cap = bytes + 1;
+			scratch = realloc(scratch, scratch_cap);
+		}
+		memcpy(scratch, run->text + run->chars[i].offset, bytes);
+		scratch[bytes] = '\0';
+		int face = run->chars[i].face;
+		SDL_Surface* surface = TTF_RenderUTF8_Blended(face ? fallback_faces[face - 1].font : run->font, scratch, text_color);
+		if (surface)
+		{
+			SDL_Rect rect = {x, plotter_y, run->char_width * cells, run->char_height};
+			draw_texture(SDL_CreateTextureFromSurface(renderer, surface), rect, 1);
+			SDL_FreeSurface(surface);
+		}
+		x += run->char_width * cells;
+	}
+}
+
+/*
+	highlight_line() marks the find matches on one line of a run, the current one outlined.
+	It also notes where the current match is, even when nothing is drawn, so the page can be scrolled to it.
+*/
+static void highlight_line(const text_run* run, size_t start, size_t end, const text_hits* hits, bool render)
+{
+	size_t from = run->chars[start].offset, to = run->chars[end].offset;
+	for (size_t h = 0; h < hits->count; ++h)
+	{
+		size_t a = hits->at[h] - hits->base, b = a + finder.needle_len;
+		if (b <= from || a >= to) continue;
+		int column = 0, first = -1, last = 0;
+		for (size_t i = start; i < end; ++i)
+		{
+			size_t o = run->chars[i].offset;
+			if (o >= a && o < b)
+			{
+				if (first < 0) first = column;
+				last = column + run->chars[i].cells;
+			}
+			column += run->chars[i].cells;
+		}
+		if (first < 0) continue;
+		_Bool current = hits->first + h == finder.current;
+		if (current) finder.current_y = plotter_y - scroll_offset;
+		if (!render) continue;
+		SDL_Rect box = {.x = plotter_x + first * run->char_width, .y = plotter_y, .w = (last - first) * run->char_width, .h = run->char_height};
+		draw_prim_rect(fill_rect, SPCOLOUR, box);
+		if (current) draw_prim_rect(outline_rect, HLCOLOUR, box);
+	}
+}
+
+/*
+	render_text() draws text to the screen in a specified font. 'render' specifies whether to actually draw or simulate drawing.
+	This implements a home-grown organic text wrapping algorithm.
+	Find matches in the text, if there are any, are highlighted.
+*/
+static void render_text(const char* text, SDL_Renderer* renderer, TTF_Font* font, bool render, const text_hits* hits)
+{
+	// This algorithm writes wrapped text to the window and updates the plotter variables accordingly.
+	// It works in columns of the monospaced font, with the widths worked out when the text was shaped.
+	(void)renderer;
+	const text_run* run = shape_text(text, font);
+	size_t start = 0;
+	bool first_line = true;
+	for (;;)
+	{
+		int room = (window_width - plotter_x - MARGIN_WIDTH) / run->char_width; // Calculate how many columns we have to work with
+		size_t end, brk = SIZE_MAX, resume = 0;
+		if (first_line && plotter_x > MARGIN_WIDTH) brk = resume = start; // A word that doesn't fit after other text moves down whole
+		int columns = 0;
+		bool more_lines = false;
+		for (end = start; end < run->count; ++end) // Iterate over the characters until we find place for a linebreak
+		{
+			const shaped_char* c = &run->chars[end];
+			if (c->brk == newline_break) // Newlines are always linebreaks
+			{
+				brk = end;
+				resume = end + 1;
+				more_lines = true;
+				break;
+			}
+			if (c->brk == space_break) brk = end, resume = end + 1; // Whitespace is a valid position for an inserted linebreak
+			if (brk != SIZE_MAX && columns + c->cells > room)
+			{
+				more_lines = true;
+				break;
+			}
+			columns += c->cells;
+		}
+		if (more_lines) end = brk;
+		if (hits) highlight_line(run, start, end, hits, render);
+		if (render) draw_text_line(run, start, end);
+		if (!more_lines)
+		{
+			plotter_x += run->char_width * columns;
+			break;
+		}
+		plotter_y += run->char_height; // Update the plotter variables for the next line
+		plotter_x = MARGIN_WIDTH;
+		start = resume;
+		first_line = false;
+	}
+}
+
+/*
+	print_tag_hashes() is a debugging function to print the hashes for the html tags so i can put them in a switch.
+*/
+static void print_tag_hashes(void)
+{
+	char* arr[] = {"TR", "TD", "TH", "TITLE", "P", "A", "I", "B", "BR", "SCRIPT", "STYLE", "EM", "H1", "H2", "H3", "H4", "H5", "H6", "IMG", "FORM", "INPUT"};
+	for (size_t i = 0; i < sizeof(arr) / sizeof(arr[0]); ++i)
+		printf("#define %s_TAG %u\n", arr[i], insensitive_hash(arr[i]));
+}
+
+/*
+	trace_startup() prints how long it has been since launch, if --startup-trace was given.
+*/
+static void trace_startup(const char* milestone)
+{
+	if (!startup_trace) return;
+	double ms = (SDL_GetPerformanceCounter() - startup_time) * 1000.0 / SDL_GetPerformanceFrequency();
+	fprintf(stderr, "[startup] %-12s %8.2f ms\n", milestone, ms);
+}
+
+/*
+	map_file() maps a whole file into memory read-only. The result has NULL data if it can't be mapped.
+*/
+static mapped_file map_file(const char* path)
+{
+	mapped_file f = {0};
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return f;
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size > 0)
+	{
+		void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) f = (mapped_file){.data = data, .size = st.st_size};
+	}
+	close(fd);
+	return f;
+}
+
+/*
+	unmap_file() unmaps a file mapped by map_file().
+*/
+static void unmap_file(mapped_file f)
+{
+	if (f.data) munmap((void*)f.data, f.size);
+}
+
+/*
+	map_data_file() finds one of our data files and maps it. It looks in the install prefix if there is one,
+	then next to the executable, then in the current directory.
+*/
+static mapped_file map_data_file(const char* name)
+{
+	char path[4096];
+	mapped_file f = {0};
+#ifdef ERSATZ_DATADIR
+	snprintf(path, sizeof path, "%s/%s", ERSATZ_DATADIR, name);
+	f = map_file(path);
+#endif
+	char* base = SDL_GetBasePath();
+	if (!f.data && base)
+	{
+		snprintf(path, sizeof path, "%s%s", base, name);
+		f = map_file(path);
+	}
+	SDL_free(base);
+	if (!f.data) f = map_file(name);
+	if (!f.data) throw_error("Cannot find %s", name);
+	return f;
+}
+
+/*
+	init_image_codec() loads the image library's decoder for an image's format the first time we see one.
+	It may be called from any loader thread.
+*/
+static void init_image_codec(SDL_RWops* rw)
+{
+	static SDL_SpinLock lock;
+	static int loaded = 0;
+	int codec = IMG_isPNG(rw) ? IMG_INIT_PNG : IMG_isJPG(rw) ? IMG_INIT_JPG : IMG_isWEBP(rw) ? IMG_INIT_WEBP : IMG_isTIF(rw) ? IMG_INIT_TIF : 0;
+	SDL_AtomicLock(&lock);
+	if (codec & ~loaded) loaded |= IMG_Init(codec);
+	SDL_AtomicUnlock(&lock);
+}
+
+/*
+	free_buffer() frees a buffer filled by write_to_buffer().
+*/
+static void free_buffer(buffer* b)
+{
+	track_free(mem_buffers, b->data);
+	*b = (buffer){0};
+}
+
+/*
+	reset_buffer() empties a buffer before a download attempt.
+*/
+static void reset_buffer(void* ptr)
+{
+	((buffer*)ptr)->len = 0;
+}
+
+/*
+	write_to_buffer() is a curl write callback that appends data to a buffer.
+*/
+static size_t write_to_buffer(char* data, size_t size, size_t nmemb, void* ptr)
+{
+	buffer* b = ptr;
+	size_t bytes = size * nmemb;
+	if (b->len + bytes > b->cap)
+	{
+		b->cap = (b->len + bytes) * 2;
+		b->data = track_realloc(mem_buffers, b->data, b->cap);
+	}
+	memcpy(b->data + b->len, data, bytes);
+	b->len += bytes;
+	return bytes;
+}
+
+/*
+	url_host() returns the host part of a url as an interned string, or NULL if it has none.
+*/
+static const char* url_host(const char* url)
+{
+	CURLU* h = curl_url();
+	char* host = NULL;
+	const char* ret = NULL;
+	if (!curl_url_set(h, CURLUPART_URL, url, CURLU_GUESS_SCHEME) && !curl_url_get(h, CURLUPART_HOST, &host, 0))
+		ret = intern(host);
+	curl_free(host);
+	curl_url_cleanup(h);
+	return ret;
+}
+
+/*
+	host_slot() finds the circuit breaker for a host, taking over its slot if another host had it.
+	The caller holds host_lock.
+*/
+static host_health* host_slot(const char* host)
+{
+	host_health* h = &hosts[((uintptr_t)host >> 3) % HOST_SLOTS];
+	if (h->host != host) *h = (host_health){.host = host};
+	return h;
+}
+
+/*
+	host_available() returns false while a host's circuit breaker is open.
+	Once the cooldown is over one request is let through, and its result decides what happens next.
+	The breaker stays open for everything else meanwhile, and if the probe never reports back another goes after
+	the next cooldown.
+*/
+static _Bool host_available(const char* host)
+{
+	if (!host) return true;
+	SDL_AtomicLock(&host_lock);
+	host_health* h = host_slot(host);
+	Uint32 now = SDL_GetTicks();
+	_Bool ok = h->failures < HOST_MAX_FAILURES || now >= h->open_until;
+	if (ok && h->failures >= HOST_MAX_FAILURES) h->open_until = now + HOST_COOLDOWN_MS; // This is the probe
+	SDL_AtomicUnlock(&host_lock);
+	return ok;
+}
+
+/*
+	record_host_result() updates a host's circuit breaker after a fetch.
+*/
+static void record_host_result(const char* host, _Bool ok)
+{
+	if (!host) return;
+	SDL_AtomicLock(&host_lock);
+	host_health* h = host_slot(host);
+	if (ok) h->failures = 0;
+	else if (++h->failures >= HOST_MAX_FAILURES) h->open_until = SDL_GetTicks() + HOST_COOLDOWN_MS;
+	SDL_AtomicUnlock(&host_lock);
+}
+
+/*
+	take_escape() is an SDL event filter that takes Escape presses out of the queue, cancelling the token it is given.
+	Every other event stays where it was.
+*/
+static int take_escape(void* ptr, SDL_Event* e)
+{
+	if (e->type != SDL_KEYDOWN || e->key.keysym.sym != SDLK_ESCAPE) return 1;
+	SDL_AtomicSet(&((cancel_token*)ptr)->cancelled, 1);
+	return 0;
+}
+
+/*
+	is_cancelled() checks a cancel token. If the token watches input, Escape or closing the window cancels it.
+	Only the Escape presses are taken from the queue, so the main loop still sees the quit event and any other keys.
+*/
+static _Bool is_cancelled(cancel_token* cancel)
+{
+	if (!cancel) return false;
+	if (cancel->watch_input)
+	{
+		SDL_PumpEvents();
+		if (SDL_HasEvent(SDL_QUIT)) SDL_AtomicSet(&cancel->cancelled, 1);
+		SDL_FilterEvents(take_escape, cancel);
+	}
+	return SDL_AtomicGet(&cancel->cancelled);
+}
+
+/*
+	fetch_progress() is a curl progress callback. Returning non-zero aborts the transfer.
+*/
+static int fetch_progress(void* ptr, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+	(void)dltotal;
+	(void)dlnow;
+	(void)ultotal;
+	(void)ulnow;
+	return is_cancelled(ptr);
+}
+
+/*
+	is_retryable() returns true for errors that might go away if we try again.
+*/
+static _Bool is_retryable(CURLcode err)
+{
+	switch (err)
+	{
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_PARTIAL_FILE:
+		case CURLE_HTTP2:
+		case CURLE_HTTP2_STREAM:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+	backoff() waits before retry number 'attempt', doubling the wait each time with some random jitter,
+	so a crowd of clients doesn't hammer a struggling server in lockstep. It returns false if cancelled while waiting.
+*/
+static _Bool backoff(const fetch_policy* policy, int attempt, cancel_token* cancel)
+{
+	static _Thread_local unsigned seed = 0;
+	if (!seed) seed = SDL_GetPerformanceCounter();
+	Uint32 wait = policy->backoff_base_ms << (attempt < 16 ? attempt : 16);
+	if (wait > policy->backoff_max_ms || !wait) wait = policy->backoff_max_ms;
+	wait = wait / 2 + rand_r(&seed) % (wait / 2 + 1);
+	for (Uint32 end = SDL_GetTicks() + wait; SDL_GetTicks() < end; SDL_Delay(20))
+		if (is_cancelled(cancel)) return false;
+	return true;
+}
+
+/*
+	perform_fetch() runs a transfer under a fetch policy. The caller has set the url and where the data goes.
+	Before each attempt reset() is called, so a failed attempt doesn't leave half a download behind.
+	On failure, a description of what went wrong is written to error, which is CURL_ERROR_SIZE long.
+*/
+static CURLcode perform_fetch(CURL* handle, const char* url, const fetch_policy* policy, cancel_token* cancel,
+	fetch_reset reset, void* reset_data, char* error)
+{
+	const char* host = url_host(url);
+	if (!host_available(host))
+	{
+		snprintf(error, CURL_ERROR_SIZE, "%s keeps failing, so it is being left alone for a while", host);
+		return CURLE_COULDNT_CONNECT;
+	}
+	error[0] = '\0';
+	curl_easy_setopt(handle, CURLOPT_URL, url);
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, policy->connect_timeout_ms);
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, policy->total_timeout_ms);
+	curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, policy->stall_bytes_per_sec);
+	curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, policy->stall_seconds);
+	curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, error);
+	curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, fetch_progress);
+	curl_easy_setopt(handle, CURLOPT_XFERINFODATA, cancel);
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+	CURLcode err;
+	for (int attempt = 0;; ++attempt)
+	{
+		reset(reset_data);
+		err = curl_easy_perform(handle);
+		if (!err || !is_retryable(err) || attempt + 1 >= policy->max_attempts) break;
+		fprintf(stderr, "(%s, retrying) ", curl_easy_strerror(err));
+		if (!backoff(policy, attempt, cancel))
+		{
+			err = CURLE_ABORTED_BY_CALLBACK;
+			break;
+		}
+	}
+	// The error buffer and token belong to our caller, so the handle mustn't keep pointing at them.
+	curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, NULL);
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt(handle, CURLOPT_XFERINFODATA, NULL);
+	if (err == CURLE_ABORTED_BY_CALLBACK) snprintf(error, CURL_ERROR_SIZE, "Cancelled");
+	else if (err && !error[0]) snprintf(error, CURL_ERROR_SIZE, "%s", curl_easy_strerror(err));
+	// Only trouble reaching the host counts against it.
+	if (!err || is_retryable(err)) record_host_result(host, !err);
+	return err;
+}
+
+/*
+	write_to_parser() is a curl write callback that feeds decoded data straight into a libxml push parser.
+*/
+static size_t write_to_parser(char* data, size_t size, size_t nmemb, void* ptr)
+{
+	parse_target* target = ptr;
+	size_t bytes = size * nmemb;
+	if (!target->ctxt) return 0;
+	target->stats->decoded_bytes += bytes;
+	htmlParseChunk(target->ctxt, data, bytes, 0);
+	return bytes;
+}
+
+/*
+	read_header() is a curl header callback that notes how long a response says it may be cached for, and how big its headers are.
+	A status line starts a new response, after a redirect or a retry, so whatever the last one said is forgotten.
+*/
+static size_t read_header(char* data, size_t size, size_t nmemb, void* ptr)
+{
+	parse_target* target = ptr;
+	size_t bytes = size * nmemb;
+	char line[512];
+	size_t len = bytes < sizeof line ? bytes : sizeof line - 1;
+	for (size_t i = 0; i < len; ++i) line[i] = tolower((unsigned char)data[i]);
+	line[len] = '\0';
+	if (!strncmp(line, "http/", 5))
+	{
+		target->no_store = 0;
+		target->max_age = -1;
+		target->age = 0;
+		target->expires = 0;
+		target->header_bytes = 0;
+	}
+	else if (!strncmp(line, "cache-control:", 14))
+	{
+		// We can't check back with the server, so no-cache is as good as no-store. Private is fine, as we are the user.
+		if (strstr(line, "no-store") || strstr(line, "no-cache")) target->no_store = 1;
+		const char* max_age = strstr(line, "max-age=");
+		if (max_age) target->max_age = strtol(max_age + 8, NULL, 10);
+	}
+	else if (!strncmp(line, "age:", 4)) target->age = strtol(line + 4, NULL, 10);
+	else if (!strncmp(line, "expires:", 8))
+	{
+		// An Expires that doesn't parse means already expired.
+		time_t t = curl_getdate(line + 8, NULL);
+		target->expires = t > 0 ? t : 1;
+	}
+	target->header_bytes += bytes;
+	return bytes;
+}
+
+/*
+	cache_lifetime() works out how many seconds a response can be cached for from what read_header() found.
+	Pages that say nothing aren't cached, as there is no telling how long they stay the same.
+*/
+static long cache_lifetime(const parse_target* target)
+{
+	if (target->no_store) return 0;
+	long lifetime = target->max_age >= 0 ? target->max_age - target->age
+		: target->expires ? (long)(target->expires - time(NULL)) : 0;
+	return lifetime > 0 ? lifetime : 0;
+}
+
+/*
+	reset_parse_target() gives a download a fresh parser and counters, throwing away whatever a failed
+	attempt had built.
+*/
+static void reset_parse_target(void* ptr)
+{
+	parse_target* target = ptr;
+	if (target->ctxt)
+	{
+		htmlFreeParserCtxt(target->ctxt);
+		parsed_page partial = finish_builder(&target->builder);
+		free_parsed_page(&partial);
+	}
+	target->ctxt = create_page_parser(&target->builder, target->url, HTML_PARSE_NOBLANKS | HTML_PARSE_NONET);
+	*target->stats = (fetch_stats){0};
+}
+
+/*
+	append_string() adds a string to the end of a buffer, without its null byte.
+*/
+static void append_string(buffer* b, const char* str)
+{
+	write_to_buffer((char*)str, 1, strlen(str), b);
+}
+
+/*
+	append_urlencoded() adds a string to a buffer the way forms encode names and values,
+	with spaces as pluses and anything unusual as percent escapes.
+*/
+static void append_urlencoded(buffer* b, const char* str)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	for (const unsigned char* c = (const unsigned char*)str; *c; ++c)
+	{
+		char escaped[3] = {'%', hex[*c >> 4], hex[*c & 15]};
+		if (isalnum(*c) || strchr("*-._", *c)) write_to_buffer((char*)c, 1, 1, b);
+		else if (*c == ' ') write_to_buffer("+", 1, 1, b);
+		else write_to_buffer(escaped, 1, 3, b);
+	}
+}
+
+/*
+	append_multipart() adds one field to a multipart/form-data body.
+	Quotes and line breaks in the name are escaped, so they can't break out of the header.
+*/
+static void append_multipart(buffer* b, const char* boundary, const char* name, const char* value)
+{
+	append_string(b, "--");
+	append_string(b, boundary);
+	append_string(b, "\r\nContent-Disposition: form-data; name=\"");
+	for (const char* c = name; *c; ++c)
+	{
+		if (*c == '"') append_string(b, "%22");
+		else if (*c == '\r') append_string(b, "%0D");
+		else if (*c == '\n') append_string(b, "%0A");
+		else write_to_buffer((char*)c, 1, 1, b);
+	}
+	append_string(b, "\"\r\n\r\n");
+	append_string(b, value);
+	append_string(b, "\r\n");
+}
+
+/*
+	build_request() makes the request that submits a form on the page on screen. Every named field is sent,
+	apart from submit buttons other than the one that was clicked. The body grows to fit, however long the values are.
+	A GET puts the fields in the url instead, in place of any query the action had.
+*/
+static request* build_request(const form* f, const form_field* submitter, const char* base_url)
+{
+	request* req = track_calloc(mem_buffers, 1, sizeof *req);
+	req->method = f->method;
+	const char* action = resolve_url(&page_strings, base_url, f->action);
+	char boundary[40];
+	_Bool multi = f->method == post && f->enctype == multipart;
+	snprintf(boundary, sizeof boundary, "ErsatzFormBoundary%016llx",
+		(unsigned long long)SDL_GetPerformanceCounter() * 0x9E3779B97F4A7C15ull);
+	for (const form_field* field = f->fields; field; field = field->next)
+	{
+		if (!field->name || (field->kind == submit_field && field != submitter)) continue;
+		if (multi) append_multipart(&req->body, boundary, field->name, field_value(field));
+		else
+		{
+			if (req->body.len) append_string(&req->body, "&");
+			append_urlencoded(&req->body, field->name);
+			append_string(&req->body, "=");
+			append_urlencoded(&req->body, field_value(field));
+		}
+	}
+	if (multi)
+	{
+		append_string(&req->body, "--");
+		append_string(&req->body, boundary);
+		append_string(&req->body, "--\r\n");
+		snprintf(req->content_type, sizeof req->content_type, "Content-Type: multipart/form-data; boundary=%s", boundary);
+	}
+	else snprintf(req->content_type, sizeof req->content_type, "Content-Type: application/x-www-form-urlencoded");
+	// The action goes with the page, so the request keeps its own copy.
+	if (f->method == get)
+	{
+		write_to_buffer((char*)action, 1, strcspn(action, "?#"), &req->own_url);
+		append_string(&req->own_url, "?");
+		write_to_buffer(req->body.data ? req->body.data : "", 1, req->body.len, &req->own_url);
+		free_buffer(&req->body);
+	}
+	else append_string(&req->own_url, action);
+	write_to_buffer("", 1, 1, &req->own_url);
+	req->url = req->own_url.data;
+	return req;
+}
+
+/*
+	submits_on_enter() says whether pressing Enter in a text box sends its form straight away.
+	It does if it is the only text box, or the last one in a form with no submit button.
+	Otherwise the rest of the form can be filled in first.
+*/
+static _Bool submits_on_enter(const form_field* field)
+{
+	int boxes = 0;
+	_Bool button = 0, last = 1;
+	for (const form_field* f = field->form->fields; f; f = f->next)
+	{
+		if (f->kind == submit_field) button = 1;
+		if (f->kind != text_field && f->kind != secret_field) continue;
+		boxes++;
+		last = f == field;
+	}
+	return boxes == 1 || (!button && last);
+}
+
+/*
+	free_request() frees a request made by build_request().
+*/
+static void free_request(request* req)
+{
+	if (!req) return;
+	free_buffer(&req->body);
+	free_buffer(&req->own_url);
+	track_free(mem_buffers, req);
+}
+
+/*
+	url_to_page() downloads a url and builds its page as it arrives.
+	The response is decompressed by curl and streamed into the parser, so nothing touches the disk,
+	and no document is kept: the nodes are made as the parser goes.
+	A POST sends the request's body. Every option set for one request is put back afterwards,
+	so the next request on the handle is a plain GET again.
+	The byte counters for the download are left in stats.
+	On failure it returns 0, with the reason in error.
+*/
+static _Bool url_to_page(CURL* handle, const request* req, fetch_stats* stats, cancel_token* cancel, parsed_page* page, char* error)
+{
+	const char* url = req->url;
+	fprintf(stderr, "%s %s... ", req->method == post ? "Posting to" : "Downloading", url);
+	xmlSubstituteEntitiesDefault(true);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_to_parser);
+	parse_target target = {.ctxt = NULL, .url = url, .stats = stats, .max_age = -1};
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &target);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, read_header);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, &target);
+	struct curl_slist* headers = NULL;
+	if (req->method == post)
+	{
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req->body.len);
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, req->body.data ? req->body.data : "");
+		headers = curl_slist_append(NULL, req->content_type);
+		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+	}
+	CURLcode err = perform_fetch(handle, url, req->method == post ? &submit_policy : &page_policy,
+		cancel, reset_parse_target, &target, error);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, NULL);
+	if (req->method == post)
+	{
+		curl_easy_setopt(handle, CURLOPT_HTTPGET, 1L);
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, NULL);
+		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, NULL);
+		curl_slist_free_all(headers);
+	}
+	if (!err && !target.ctxt) snprintf(error, CURL_ERROR_SIZE, "Cannot parse page");
+	if (target.ctxt)
+	{
+		if (!err) htmlParseChunk(target.ctxt, NULL, 0, 1); // Tell the parser the document is finished
+		htmlFreeParserCtxt(target.ctxt);
+		*page = finish_builder(&target.builder);
+		page->cache_for = cache_lifetime(&target);
+	}
+	if (err || !target.ctxt)
+	{
+		// The images and strings go with the rest of the page, so nothing of it is left to hand back.
+		if (target.ctxt) free_parsed_page(page);
+		else *page = (parsed_page){0};
+		fprintf(stderr, "Failed. (%s)\n", error);
+		return 0;
+	}
+	// Curl starts the body count again for each redirect it follows, so both halves are for the final response.
+	curl_off_t body_bytes = 0;
+	curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &body_bytes);
+	stats->wire_bytes = body_bytes + target.header_bytes;
+	fprintf(stderr, "Done. (%" CURL_FORMAT_CURL_OFF_T " bytes on the wire, %" CURL_FORMAT_CURL_OFF_T " decoded)\n",
+		stats->wire_bytes, stats->decoded_bytes);
+	return 1;
+}
+
+/*
+	get_attr() finds an attribute in the list libxml hands to a start tag callback.
+	It returns NULL if the attribute is missing or has no value.
+*/
+static const char* get_attr(const xmlChar** atts, const char* name)
+{
+	for (; atts && atts[0]; atts += 2)
+		if (!strcasecmp((const char*)atts[0], name)) return (const char*)atts[1];
+	return NULL;
+}
+
+/*
+	page_attr() finds an attribute like get_attr(), and keeps its value in the page's strings.
+*/
+static const char* page_attr(page_builder* b, const xmlChar** atts, const char* name)
+{
+	const char* value = get_attr(atts, name);
+	return value ? intern_in(&b->page.strings, value, strlen(value)) : NULL;
+}
+
+/*
+	get_size_attr() reads a width or height attribute in pixels, returning 0 if it is missing or not in pixels.
+*/
+static int get_size_attr(const xmlChar** atts, const char* name)
+{
+	const char* prop = get_attr(atts, name);
+	if (!prop) return 0;
+	char* end;
+	long size = strtol(prop, &end, 10);
+	if (*end && strcmp(end, "px")) size = 0; // Percentages and the like depend on layout we don't do
+	return size > 0 && size < 100000 ? size : 0;
+}
+
+/*
+	emit_node() adds a node to the end of the page being built.
+*/
+static void emit_node(page_builder* b, node_type type, const void* data)
+{
+	node* n = track_malloc(mem_nodes, sizeof *n);
+	*n = (node){.type = type, .data = data};
+	*b->tail = n;
+	b->tail = &n->next;
+}
+
+/*
+	flush_text() turns the text gathered since the last tag into a node, or the title if we are in one.
+	Newlines become spaces, and text that is only whitespace is dropped.
+*/
+static void flush_text(page_builder* b)
+{
+	buffer* c = &b->chars;
+	if (!c->len) return;
+	if (b->in_title)
+	{
+		if (!b->page.title) b->page.title = intern_in(&b->page.strings, c->data, c->len);
+	}
+	else if (!b->skipping)
+	{
+		char* str = track_malloc(mem_text, c->len + 1);
+		memcpy(str, c->data, c->len);
+		str[c->len] = '\0';
+		for (char* ptr = str; *ptr ; ptr++) // Delete all newlines
+			if (*ptr == '\n') *ptr = ' ';
+		if (str[strspn(str, " \r\t")] != '\0') // trick to remove whitespace lines.
+			emit_node(b, text, str);
+		else
+			track_free(mem_text, str);
+	}
+	c->len = 0;
+}
+
+#define TR_TAG 7609598
+#define TD_TAG 7609584
+#define TH_TAG 7609588
 #define TITLE_TAG 368167992
 #define P_TAG 112
 #define A_TAG 97
@@ -412,347 +2480,3077 @@ static const node* simplify_html(htmlNodePtr ptr, const node* head)
 #define IMG_TAG 874608419
 #define FORM_TAG 3234988420
 #define INPUT_TAG 293375786
-						case TITLE_TAG:
-							window_title = (char*)ptr->children->content;
-						case SCRIPT_TAG:
-						case STYLE_TAG:
-							// Ignore child text
-							break;
-						default:
-							// Ignore tag, but not text (default behavior for unknown tag)
-							head = simplify_html(ptr->last, head);
-							break;
-						case B_TAG:
-						case EM_TAG:
-							// Bold text
-							head =
-								alloc_node(make_bold, NULL,
-									simplify_html(ptr->last,
-										alloc_node(remove_bold, NULL, head)));
-							break;
-						case I_TAG:
-							// Italic text
-							head =
-								alloc_node(make_italic, NULL,
-									simplify_html(ptr->last,
-										alloc_node(remove_italic, NULL, head)));
-							break;
-						case H1_TAG:
-						case H2_TAG:
-						case H3_TAG:
-						case H4_TAG:
-						case H5_TAG:
-						case H6_TAG:
-							// Bold and spaced out
-							head =
-								alloc_node(seperator, NULL,
-									alloc_node(make_bold, NULL,
-										simplify_html(ptr->last,
-											alloc_node(remove_bold, NULL,
-												alloc_node(seperator, NULL, head)))));
-							break;
-						case P_TAG:
-						case TR_TAG:
-							// Just spaced out
-							head =
-								alloc_node(seperator, NULL,
-									simplify_html(ptr->last,
-										alloc_node(seperator, NULL, head)));
-							break;
-						case BR_TAG:
-							// Newline
-							head = alloc_node(text, strdup("\n"), simplify_html(ptr->last, head));
-							break;
-						case A_TAG:
-							// Hyperlink
-							// <a> tags cannot be nested, which is truly a blessing
-							{
-								char* href = (char*)xmlGetProp(ptr, (xmlChar*)"href");
-								head =
-									alloc_node(hyperlink, href,
-										simplify_html(ptr->last,
-											alloc_node(end_hyperlink, NULL, head)));
-							}
-							break;
-						case IMG_TAG:
-							{
-								char* src = (char*)xmlGetProp(ptr, (xmlChar*)"src");
-								if (!src) goto err;
-								char* full_url = add_urls(current_url, src);
-								FILE* img = url_to_file(full_url);
-								SDL_RWops* rw = SDL_RWFromFP(img, 0);
-								SDL_Surface* surface = IMG_Load_RW(rw, 0);
-								fclose(img);
-								free(src);
-								free(rw);
-								free(full_url);
-								if (!surface) goto err;
-								head =
-									alloc_node(image, surface,
-										simplify_html(ptr->last, head));
-							}
-							break;
-						case FORM_TAG:
-						{
-							form_action = (char*)xmlGetProp(ptr, (xmlChar*)"action");
-							char* met = (char*)xmlGetProp(ptr, (xmlChar*)"method");
-							form_method = !met || met[0] == 'g' ? get : post;
-							free(met);
-							head = simplify_html(ptr->last, head);
-						}
-						break;
-						case INPUT_TAG:
+
+/*
+	add_field() makes an input into a field of the form it is in.
+	An input outside any form gets a form of its own, which sends it to the current page.
+*/
+static void add_field(page_builder* b, field_kind kind, const xmlChar** atts)
+{
+	form* f = b->current_form;
+	if (!f)
+	{
+		f = track_calloc(mem_nodes, 1, sizeof *f);
+		f->method = get;
+		emit_node(b, form_start, f);
+	}
+	form_field* field = track_calloc(mem_nodes, 1, sizeof *field);
+	field->form = f;
+	field->kind = kind;
+	field->name = page_attr(b, atts, "name");
+	const char* value = get_attr(atts, "value");
+	field->value = value ? track_strdup(mem_text, value) : NULL;
+	form_field** last = &f->fields;
+	while (*last) last = &(*last)->next;
+	*last = field;
+	emit_node(b, input, field);
+}
+
+/*
+	start_element() is the SAX callback for an opening tag.
+	The tag goes on the stack, so end_element() knows what it has to close.
+*/
+static void start_element(void* ptr, const xmlChar* name, const xmlChar** atts)
+{
+	page_builder* b = ptr;
+	flush_text(b);
+	unsigned tag = insensitive_hash((const char*)name);
+	if (b->depth == b->stack_cap)
+	{
+		b->stack_cap = b->stack_cap ? b->stack_cap * 2 : 64;
+		b->stack = track_realloc(mem_buffers, b->stack, b->stack_cap * sizeof *b->stack);
+	}
+	b->stack[b->depth++] = (open_tag){.tag = tag, .outer = b->current_form};
+	switch (tag)
+	{
+		case TITLE_TAG:
+			// The title goes in the window's title bar, not the page.
+			b->in_title = 1;
+			break;
+		case SCRIPT_TAG:
+		case STYLE_TAG:
+			// Ignore child text
+			b->skipping++;
+			break;
+		case B_TAG:
+		case EM_TAG:
+			// Bold text
+			emit_node(b, make_bold, NULL);
+			break;
+		case I_TAG:
+			// Italic text
+			emit_node(b, make_italic, NULL);
+			break;
+		case H1_TAG:
+		case H2_TAG:
+		case H3_TAG:
+		case H4_TAG:
+		case H5_TAG:
+		case H6_TAG:
+			// Bold and spaced out
+			emit_node(b, seperator, NULL);
+			emit_node(b, make_bold, NULL);
+			break;
+		case P_TAG:
+		case TR_TAG:
+			// Just spaced out
+			emit_node(b, seperator, NULL);
+			break;
+		case BR_TAG:
+			// Newline
+			emit_node(b, text, track_strdup(mem_text, "\n"));
+			break;
+		case A_TAG:
+			// Hyperlink
+			// <a> tags cannot be nested, which is truly a blessing
+			emit_node(b, hyperlink, page_attr(b, atts, "href"));
+			break;
+		case IMG_TAG:
+		{
+			// Images are fetched later, when they scroll near the viewport.
+			const char* src = page_attr(b, atts, "src");
+			if (!src) break;
+			lazy_image* img = track_calloc(mem_images, 1, sizeof *img);
+			img->src = src;
+			img->width = get_size_attr(atts, "width");
+			img->height = get_size_attr(atts, "height");
+			*b->image_tail = img;
+			b->image_tail = &img->next;
+			emit_node(b, image, img);
+		}
+		break;
+		case FORM_TAG:
+		{
+			// Inputs join the form around them, and the outer form comes back when this one closes.
+			form* f = track_calloc(mem_nodes, 1, sizeof *f);
+			f->action = page_attr(b, atts, "action");
+			const char* met = get_attr(atts, "method");
+			f->method = met && tolower(met[0]) == 'p' ? post : get;
+			const char* enc = get_attr(atts, "enctype");
+			f->enctype = enc && !strcasecmp(enc, "multipart/form-data") ? multipart : urlencoded;
+			b->current_form = f;
+			emit_node(b, form_start, f);
+		}
+		break;
+		case INPUT_TAG:
+		{
+			int kind = field_kind_of(get_attr(atts, "type"));
+			// Checkboxes and the like aren't supported, so they aren't sent either.
+			if (kind >= 0) add_field(b, kind, atts);
+		}
+		break;
+		default:
+			// Ignore tag, but not text (default behavior for unknown tag)
+			break;
+	}
+}
+
+/*
+	close_tag() emits whatever ends an element that start_element() began.
+*/
+static void close_tag(page_builder* b, const open_tag* t)
+{
+	switch (t->tag)
+	{
+		case TITLE_TAG: b->in_title = 0; break;
+		case SCRIPT_TAG:
+		case STYLE_TAG: b->skipping--; break;
+		case B_TAG:
+		case EM_TAG: emit_node(b, remove_bold, NULL); break;
+		case I_TAG: emit_node(b, remove_italic, NULL); break;
+		case H1_TAG:
+		case H2_TAG:
+		case H3_TAG:
+		case H4_TAG:
+		case H5_TAG:
+		case H6_TAG:
+			emit_node(b, remove_bold, NULL);
+			emit_node(b, seperator, NULL);
+			break;
+		case P_TAG:
+		case TR_TAG: emit_node(b, seperator, NULL); break;
+		case A_TAG: emit_node(b, end_hyperlink, NULL); break;
+		case FORM_TAG: b->current_form = t->outer; break;
+		default: break;
+	}
+}
+
+/*
+	end_element() is the SAX callback for a closing tag.
+	libxml closes anything left open inside an element before the element itself, but a stray closing tag
+	for something we aren't in is ignored.
+*/
+static void end_element(void* ptr, const xmlChar* name)
+{
+	page_builder* b = ptr;
+	flush_text(b);
+	unsigned tag = insensitive_hash((const char*)name);
+	size_t d = b->depth;
+	while (d && b->stack[d - 1].tag != tag) d--;
+	if (!d) return;
+	while (b->depth >= d) close_tag(b, &b->stack[--b->depth]);
+}
+
+/*
+	characters() is the SAX callback for text. One run of text can come in several calls,
+	so it is gathered up until the next tag.
+*/
+static void characters(void* ptr, const xmlChar* ch, int len)
+{
+	page_builder* b = ptr;
+	if (b->skipping && !b->in_title) return;
+	write_to_buffer((char*)ch, 1, len, &b->chars);
+}
+
+/*
+	create_page_parser() makes a push parser that builds a page straight into b as it goes.
+	The SAX handler only has element and text callbacks, so libxml never builds a document tree.
+*/
+static htmlParserCtxtPtr create_page_parser(page_builder* b, const char* url, int options)
+{
+	static htmlSAXHandler handler = {
+		.startElement = start_element,
+		.endElement = end_element,
+		.characters = characters,
+	};
+	*b = (page_builder){0};
+	b->tail = &b->page.nodes;
+	b->image_tail = &b->page.images;
+	htmlParserCtxtPtr ctxt = htmlCreatePushParserCtxt(&handler, b, NULL, 0, url, XML_CHAR_ENCODING_NONE);
+	if (ctxt) htmlCtxtUseOptions(ctxt, options);
+	return ctxt;
+}
+
+/*
+	finish_builder() closes anything still open, frees the builder's scratch space, and returns the page.
+*/
+static parsed_page finish_builder(page_builder* b)
+{
+	flush_text(b);
+	while (b->depth) close_tag(b, &b->stack[--b->depth]);
+	track_free(mem_buffers, b->stack);
+	free_buffer(&b->chars);
+	parsed_page page = b->page;
+	*b = (page_builder){0};
+	return page;
+}
+
+/*
+	parse_html() builds a page from a whole document in memory.
+*/
+static parsed_page parse_html(const char* data, size_t size, const char* url, int options)
+{
+	page_builder b;
+	htmlParserCtxtPtr ctxt = create_page_parser(&b, url, options);
+	if (ctxt)
+	{
+		htmlParseChunk(ctxt, data, size, 1);
+		htmlFreeParserCtxt(ctxt);
+	}
+	return finish_builder(&b);
+}
+
+/*
+	free_parsed_page() frees a page made by the page builder, leaving it empty.
+*/
+static void free_parsed_page(parsed_page* page)
+{
+	dealloc_nodes(page->nodes);
+	free_intern_table(&page->strings);
+	*page = (parsed_page){0};
+}
+
+/*
+	field_kind_of() works out what kind of form field an input's type attribute makes, or returns -1 if it is
+	one we don't support.
+*/
+static int field_kind_of(const char* type)
+{
+	static const char* const text_types[] = {"text", "search", "email", "url", "tel", "number"};
+	if (!type) return text_field;
+	for (size_t i = 0; i < sizeof text_types / sizeof *text_types; ++i)
+		if (!strcasecmp(type, text_types[i])) return text_field;
+	if (!strcasecmp(type, "password")) return secret_field;
+	if (!strcasecmp(type, "hidden")) return hidden_field;
+	if (!strcasecmp(type, "submit")) return submit_field;
+	return -1;
+}
+
+/*
+	field_value() is what a form field would send: what was typed into it, or else its value attribute.
+*/
+static const char* field_value(const form_field* field)
+{
+	return field->entered ? field->entered : field->value ? field->value : "";
+}
+
+/*
+	alloc_node() simply allocates a node in memory, with arguments for the struct fields
+*/
+const node* alloc_node(node_type type, const void* data, const node* next)
+{
+	node* n = track_malloc(mem_nodes, sizeof(*n));
+	*n = (node){.type = type, .data = data, .next = next};
+	return n;
+}
+
+/*
+	print_simplified_html() is a debugging function to print a simplified html data structure.
+*/
+void print_simplified_html(const node* ptr, FILE* out)
+{
+	for (; ptr ; ptr = ptr->next)
+	{
+		switch (ptr->type)
+		{
+			case text          : fprintf(out, "%s\n", ptr->text); break;
+			case seperator	    : fputs("[SEPERATOR]\n", out); break;
+			case make_bold	    : fputs("[BEGIN BOLD]\n", out); break;
+			case remove_bold   : fputs("[END BOLD]\n", out); break;
+			case make_italic   : fputs("[BEGIN ITALIC]\n", out); break;
+			case remove_italic : fputs("[END ITALIC]\n", out); break;
+			case hyperlink     : fprintf(out, "[HYPERLINK TO %s]\n", ptr->text); break;
+			case end_hyperlink : fputs("[END HYPERLINK]\n", out); break;
+			case image         : fprintf(out, "[IMAGE FROM %s]\n", ptr->image->src); break;
+			case form_start    : fprintf(out, "[FORM TO %s]\n", ptr->form->action ? ptr->form->action : ""); break;
+			case input         : fprintf(out, "[INPUT %s]\n", ptr->field->name ? ptr->field->name : ""); break;
+			default            : break;
+		}
+	}
+}
+
+/*
+	box_downscale() shrinks an RGBA32 surface, averaging every source pixel that lands in each destination pixel.
+	Each output row sums its source rows into an accumulator first; those loops are simple enough for the
+	compiler to vectorise.
+*/
+static SDL_Surface* box_downscale(SDL_Surface* src, int dw, int dh)
+{
+	SDL_Surface* dst = SDL_CreateRGBSurfaceWithFormat(0, dw, dh, 32, SDL_PIXELFORMAT_RGBA32);
+	if (!dst) return NULL;
+	int sw = src->w, sh = src->h;
+	uint32_t* acc = malloc(sw * 4 * sizeof *acc);
+	for (int oy = 0; oy < dh; ++oy)
+	{
+		int y0 = (long)oy * sh / dh, y1 = (long)(oy + 1) * sh / dh;
+		if (y1 <= y0) y1 = y0 + 1;
+		memset(acc, 0, sw * 4 * sizeof *acc);
+		for (int y = y0; y < y1; ++y)
+		{
+			const uint8_t* row = (const uint8_t*)src->pixels + (size_t)y * src->pitch;
+			for (int i = 0; i < sw * 4; ++i) acc[i] += row[i];
+		}
+		uint8_t* out = (uint8_t*)dst->pixels + (size_t)oy * dst->pitch;
+		for (int ox = 0; ox < dw; ++ox)
+		{
+			int x0 = (long)ox * sw / dw, x1 = (long)(ox + 1) * sw / dw;
+			if (x1 <= x0) x1 = x0 + 1;
+			uint32_t area = (x1 - x0) * (y1 - y0);
+			for (int c = 0; c < 4; ++c)
+			{
+				uint32_t sum = 0;
+				for (int x = x0; x < x1; ++x) sum += acc[x * 4 + c];
+				out[ox * 4 + c] = (sum + area / 2) / area;
+			}
+		}
+	}
+	free(acc);
+	return dst;
+}
+
+/*
+	halve_surface() makes the next mip level of an RGBA32 surface by averaging each 2x2 block.
+	With SSE2 it does four output pixels at a time.
+*/
+static SDL_Surface* halve_surface(SDL_Surface* src)
+{
+	int dw = src->w / 2, dh = src->h / 2;
+	SDL_Surface* dst = SDL_CreateRGBSurfaceWithFormat(0, dw, dh, 32, SDL_PIXELFORMAT_RGBA32);
+	if (!dst) return NULL;
+	for (int y = 0; y < dh; ++y)
+	{
+		const uint8_t* r0 = (const uint8_t*)src->pixels + (size_t)(y * 2) * src->pitch;
+		const uint8_t* r1 = r0 + src->pitch;
+		uint8_t* out = (uint8_t*)dst->pixels + (size_t)y * dst->pitch;
+		int x = 0;
+#ifdef __SSE2__
+		for (; x + 4 <= dw; x += 4)
+		{
+			// Average the two rows, then split the result into even and odd pixels and average those.
+			__m128i lo = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + x * 8)), _mm_loadu_si128((const __m128i*)(r1 + x * 8)));
+			__m128i hi = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + x * 8 + 16)), _mm_loadu_si128((const __m128i*)(r1 + x * 8 + 16)));
+			__m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1)));
+			_mm_storeu_si128((__m128i*)(out + x * 4), _mm_avg_epu8(even, odd));
+		}
+#endif
+		for (; x < dw; ++x)
+			for (int c = 0; c < 4; ++c)
+				out[x * 4 + c] = (r0[x * 8 + c] + r0[x * 8 + 4 + c] + r1[x * 8 + c] + r1[x * 8 + 4 + c] + 2) / 4;
+	}
+	return dst;
+}
+
+/*
+	surface_bytes() is how much memory a surface's pixels take.
+*/
+static long surface_bytes(const SDL_Surface* s)
+{
+	return s ? (long)s->h * s->pitch : 0;
+}
+
+/*
+	make_image_texture() uploads one of an image's levels as its texture.
+*/
+static void make_image_texture(lazy_image* img, int level)
+{
+	img->texture = SDL_CreateTextureFromSurface(renderer, img->levels[level]);
+	img->texture_level = level;
+	if (img->texture) count_memory(mem_textures, (long)img->levels[level]->w * img->levels[level]->h * 4, 1);
+}
+
+/*
+	destroy_image_texture() frees an image's texture. The level it was made from must still be there.
+*/
+static void destroy_image_texture(lazy_image* img)
+{
+	if (!img->texture) return;
+	const SDL_Surface* s = img->levels[img->texture_level];
+	count_memory(mem_textures, -(long)s->w * s->h * 4, -1);
+	SDL_DestroyTexture(img->texture);
+	img->texture = NULL;
+}
+
+/*
+	free_levels() frees an image's pixels and texture.
+*/
+static void free_levels(lazy_image* img)
+{
+	destroy_image_texture(img);
+	for (int i = 0; i < MIP_LEVELS; ++i)
+	{
+		if (img->levels[i]) count_memory(mem_images, -surface_bytes(img->levels[i]), -1);
+		SDL_FreeSurface(img->levels[i]);
+		img->levels[i] = NULL;
+	}
+}
+
+/*
+	local_path() returns the path of the file a url refers to, if it is a file:// url or a path to a file.
+	It returns NULL for anything that has to be fetched over the network.
+*/
+static char* local_path(const char* url)
+{
+	if (!strncmp(url, "file://", 7))
+	{
+		size_t len = strcspn(url + 7, "?#");
+		return xmlURIUnescapeString(url + 7, len, NULL);
+	}
+	struct stat st;
+	if (stat(url, &st) || !S_ISREG(st.st_mode)) return NULL;
+	char path[PATH_MAX];
+	return realpath(url, path) ? strdup(path) : NULL;
+}
+
+/*
+	path_to_url() makes a file:// url for an absolute path, so links on the page resolve against it.
+*/
+static char* path_to_url(const char* path)
+{
+	xmlChar* escaped = xmlURIEscapeStr((const xmlChar*)path, (const xmlChar*)"/");
+	char* url = malloc(strlen((char*)escaped) + 8);
+	sprintf(url, "file://%s", (char*)escaped);
+	xmlFree(escaped);
+	return url;
+}
+
+/*
+	file_to_page() maps a local file and builds its page in place, with no copying and no curl.
+	On failure it returns 0, with the reason in error.
+*/
+static _Bool file_to_page(const char* path, const char* url, fetch_stats* stats, parsed_page* page, char* error)
+{
+	mapped_file f = map_file(path);
+	if (!f.data || f.size > INT_MAX)
+	{
+		snprintf(error, CURL_ERROR_SIZE, "Cannot read %s", path);
+		unmap_file(f);
+		return 0;
+	}
+	xmlSubstituteEntitiesDefault(true);
+	*page = parse_html(f.data, f.size, url, HTML_PARSE_NOBLANKS | HTML_PARSE_NONET);
+	*stats = (fetch_stats){.wire_bytes = 0, .decoded_bytes = f.size};
+	unmap_file(f);
+	return 1;
+}
+
+/*
+	load_page() loads a page from wherever it lives and builds it. Local files are mapped and parsed directly,
+	and everything else goes through curl. The url the page ended up at, after redirects, is put in final_url.
+	On failure it returns 0, with the reason in error, which is CURL_ERROR_SIZE long.
+*/
+static _Bool load_page(CURL* handle, const request* req, fetch_stats* stats, cancel_token* cancel, parsed_page* page, char** final_url, char* error)
+{
+	const char* url = req->url;
+	char* path = local_path(url);
+	if (path)
+	{
+		*final_url = path_to_url(path);
+		_Bool ok = file_to_page(path, *final_url, stats, page, error);
+		free(path);
+		return ok;
+	}
+	_Bool ok = url_to_page(handle, req, stats, cancel, page, error);
+	char* effective_url = NULL;
+	if (ok) curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+	*final_url = strdup(effective_url ? effective_url : url);
+	return ok;
+}
+
+/*
+	error_page() makes a page explaining why a url couldn't be loaded.
+*/
+static const node* error_page(const char* url, const char* error)
+{
+	return
+		alloc_node(make_bold, NULL,
+			alloc_node(text, track_strdup(mem_text, "Cannot load "),
+				alloc_node(text, track_strdup(mem_text, url),
+					alloc_node(remove_bold, NULL,
+						alloc_node(seperator, NULL,
+							alloc_node(text, track_strdup(mem_text, error), NULL))))));
+}
+
+/*
+	decode_image() turns the bytes of an image file into a surface.
+*/
+static SDL_Surface* decode_image(const void* data, size_t size)
+{
+	if (!size || size > INT_MAX) return NULL;
+	SDL_RWops* rw = SDL_RWFromConstMem(data, size);
+	init_image_codec(rw);
+	return IMG_Load_RW(rw, 1);
+}
+
+/*
+	load_image() is the body of an image loader thread. It fetches and decodes one image.
+	It uses its own curl handle, as handles cannot be shared between threads.
+*/
+static int load_image(void* ptr)
+{
+	lazy_image* img = ptr;
+	SDL_Surface* full = NULL;
+	char* path = local_path(img->url);
+	if (path)
+	{
+		// Local images are decoded straight from the mapped file.
+		mapped_file f = map_file(path);
+		full = decode_image(f.data, f.size);
+		unmap_file(f);
+		free(path);
+	}
+	else
+	{
+		CURL* handle = new_curl_handle();
+		buffer b = {0};
+		char error[CURL_ERROR_SIZE];
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_to_buffer);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, &b);
+		CURLcode err = perform_fetch(handle, img->url, &image_policy, &img->cancel, reset_buffer, &b, error);
+		curl_easy_cleanup(handle);
+		if (!err) full = decode_image(b.data, b.len);
+		free_buffer(&b);
+	}
+	SDL_Surface* rgba = full ? SDL_ConvertSurfaceFormat(full, SDL_PIXELFORMAT_RGBA32, 0) : NULL;
+	SDL_FreeSurface(full);
+	if (!rgba)
+	{
+		SDL_AtomicSet(&img->state, image_failed);
+		return 0;
+	}
+	// Only keep the image at the size it is shown, so big photos don't hang around at full resolution.
+	img->decoded_w = rgba->w;
+	img->decoded_h = rgba->h;
+	SDL_Surface* level = rgba;
+	if (img->target_w < rgba->w)
+	{
+		int h = (long)rgba->h * img->target_w / rgba->w;
+		level = box_downscale(rgba, img->target_w, h ? h : 1);
+		SDL_FreeSurface(rgba);
+	}
+	for (int i = 0; i < MIP_LEVELS && level; ++i)
+	{
+		img->decoded[i] = level;
+		level = i + 1 < MIP_LEVELS && level->w >= 32 && level->h >= 2 ? halve_surface(level) : NULL;
+	}
+	SDL_AtomicSet(&img->state, img->decoded[0] ? image_loaded : image_failed);
+	return 0;
+}
+
+/*
+	request_image() starts loading an image in the background, if there is a free loader and the image
+	is not already loaded at a big enough size. It will be scaled to the given width, rounded up a bit so
+	small window resizes don't set off a reload.
+*/
+static void request_image(lazy_image* img, int width)
+{
+	if (img->loader || image_loads >= MAX_IMAGE_LOADS || SDL_AtomicGet(&img->state) == image_failed) return;
+	if (img->levels[0] && (img->levels[0]->w >= width || img->levels[0]->w >= img->natural_w)) return;
+	img->target_w = (width + 63) / 64 * 64;
+	img->url = resolve_url(&page_strings, page_url, img->src);
+	SDL_AtomicSet(&img->state, image_loading);
+	img->loader = SDL_CreateThread(load_image, "image loader", img);
+	if (!img->loader)
+	{
+		SDL_AtomicSet(&img->state, image_failed);
+		return;
+	}
+	image_loads++;
+}
+
+/*
+	adopt_decoded() swaps in the levels made by a loader. The old levels stay on screen while a bigger copy
+	loads, and are only freed here.
+*/
+static void adopt_decoded(lazy_image* img)
+{
+	if (!img->decoded[0]) return;
+	free_levels(img);
+	memcpy(img->levels, img->decoded, sizeof img->levels);
+	memset(img->decoded, 0, sizeof img->decoded);
+	for (int i = 0; i < MIP_LEVELS; ++i)
+		if (img->levels[i]) count_memory(mem_images, surface_bytes(img->levels[i]), 1);
+	img->natural_w = img->decoded_w;
+	img->natural_h = img->decoded_h;
+}
+
+/*
+	finish_image_load() waits for an image's loader thread and cleans up after it.
+*/
+static void finish_image_load(lazy_image* img)
+{
+	SDL_WaitThread(img->loader, NULL);
+	img->loader = NULL;
+	image_loads--;
+	adopt_decoded(img);
+}
+
+/*
+	load_image_now() loads an image on the calling thread, for when nothing is waiting on us.
+	Its url is resolved into strings, the table of the page it is on.
+*/
+static void load_image_now(lazy_image* img, intern_table* strings, const char* base_url, int width)
+{
+	img->target_w = width;
+	img->url = resolve_url(strings, base_url, img->src);
+	load_image(img);
+	adopt_decoded(img);
+}
+
+/*
+	sweep_images() runs after each frame. It reaps finished loader threads,
+	and frees the pixels of loaded images that were not near the viewport this frame.
+*/
+static void sweep_images(void)
+{
+	for (lazy_image* img = page_images; img; img = img->next)
+	{
+		if (img->loader && SDL_AtomicGet(&img->state) != image_loading) finish_image_load(img);
+		if (img->levels[0] && !img->loader && img->last_near != frame_count)
+		{
+			free_levels(img);
+			SDL_AtomicSet(&img->state, image_unloaded);
+		}
+	}
+	frame_count++;
+}
+
+/*
+	image_size() works out how big an image should be drawn, before it is fitted to the page.
+	It uses the width and height attributes where possible, so the layout doesn't jump when the image loads.
+	It returns false if the size is only a guess.
+*/
+static _Bool image_size(const lazy_image* img, int* w, int* h)
+{
+	*w = img->width;
+	*h = img->height;
+	if (img->natural_w && img->natural_h)
+	{
+		if (!*w && !*h) *w = img->natural_w, *h = img->natural_h;
+		else if (!*h) *h = *w * img->natural_h / img->natural_w;
+		else if (!*w) *w = *h * img->natural_w / img->natural_h;
+	}
+	// Until we know better, reserve a line's worth of space.
+	_Bool known = *w && *h;
+	if (!*w) *w = TTF_FontHeight(regular_font);
+	if (!*h) *h = TTF_FontHeight(regular_font);
+	return known;
+}
+
+/*
+	user_file_path() returns the path of a file in one of our directories under the user's home, going by an XDG
+	variable or else a fallback under HOME. dir is PATH_MAX long, and keeps the directory between calls.
+	If create is one, the directory is made if it doesn't exist, along with any missing parents.
+*/
+static char* user_file_path(char* dir, const char* xdg, const char* fallback, const char* name, _Bool create)
+{
+	if (!dir[0])
+	{
+		const char* base = getenv(xdg);
+		const char* home = getenv("HOME");
+		if (base && base[0]) snprintf(dir, PATH_MAX, "%s/ersatz", base);
+		else if (home) snprintf(dir, PATH_MAX, "%s/%s/ersatz", home, fallback);
+		else return NULL;
+	}
+	if (create)
+	{
+		// The parents usually exist already, but make them if they don't.
+		for (char* slash = dir; (slash = strchr(slash + 1, '/'));)
+		{
+			*slash = '\0';
+			mkdir(dir, 0700);
+			*slash = '/';
+		}
+		if (mkdir(dir, 0700) && errno != EEXIST) return NULL;
+	}
+	char* path = malloc(strlen(dir) + strlen(name) + 2);
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+/*
+	page_cache_path() returns the file a url's simplified page is cached in, or NULL if it shouldn't be cached.
+	If create is one, the cache directory is made if it doesn't exist.
+*/
+static char* page_cache_path(const char* url, _Bool create)
+{
+	static char dir[PATH_MAX] = "";
+	if (!page_cache_age || !url) return NULL;
+	char* local = local_path(url);
+	free(local);
+	if (local) return NULL; // Local files are parsed straight from disk anyway
+	char name[16];
+	sprintf(name, "%08x.page", string_hash(url, strlen(url)));
+	return user_file_path(dir, "XDG_CACHE_HOME", ".cache", name, create);
+}
+
+/*
+	pool_add() appends a string to a string pool, returning its offset.
+*/
+static uint32_t pool_add(buffer* pool, const char* str)
+{
+	if (!str) return NO_STRING;
+	uint32_t offset = pool->len;
+	write_to_buffer((char*)str, 1, strlen(str) + 1, pool);
+	return offset;
+}
+
+/*
+	save_cached_page() writes a simplified page to the page cache, under the url that was asked for.
+	It stays fresh for cache_for seconds, or page_cache_age if that is sooner.
+	The file is written beside the old one and renamed over it, so a reader never sees half a page.
+*/
+static void save_cached_page(const char* url, const char* final_url, const node* page, const char* title, long cache_for)
+{
+	if (cache_for <= 0) return;
+	char* path = page_cache_path(url, 1);
+	if (!path) return;
+	buffer pool = {0}, nodes = {0}, forms = {0};
+	page_header h = {.magic = "ERPC", .version = PAGE_CACHE_VERSION,
+		.expires = time(NULL) + (cache_for < page_cache_age ? cache_for : page_cache_age)};
+	h.url = pool_add(&pool, url);
+	h.final_url = pool_add(&pool, final_url);
+	h.title = pool_add(&pool, title);
+	for (const node* n = page; n; n = n->next, ++h.node_count)
+	{
+		packed_node p = {.type = n->type, .a = NO_STRING, .b = NO_STRING, .c = NO_STRING};
+		switch (n->type)
+		{
+			case text:
+			case hyperlink:
+				p.a = pool_add(&pool, n->text);
+				break;
+			case image:
+				p.a = pool_add(&pool, n->image->src);
+				p.b = n->image->width;
+				p.c = n->image->height;
+				++h.image_count;
+				break;
+			case form_start:
+				p.a = pool_add(&pool, n->form->action);
+				p.b = n->form->method;
+				p.c = n->form->enctype;
+				write_to_buffer((char*)&n->form, sizeof n->form, 1, &forms);
+				++h.form_count;
+				break;
+			case input:
+			{
+				// A field refers to its form by number. Its form_start always comes first, usually just before.
+				const form** seen = (const form**)forms.data;
+				uint32_t i = h.form_count;
+				while (i > 0 && seen[i - 1] != n->field->form) --i;
+				if (!i) goto fail;
+				p.a = pool_add(&pool, n->field->name);
+				p.b = pool_add(&pool, n->field->value);
+				p.c = n->field->kind | (i - 1) << 8;
+				++h.field_count;
+				break;
+			}
+			default:
+				break;
+		}
+		write_to_buffer((char*)&p, sizeof p, 1, &nodes);
+	}
+	h.pool_size = pool.len;
+	char* tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	FILE* f = fopen(tmp, "wb");
+	if (f)
+	{
+		_Bool ok = fwrite(&h, sizeof h, 1, f) == 1
+			&& fwrite(nodes.data, 1, nodes.len, f) == nodes.len
+			&& fwrite(pool.data, 1, pool.len, f) == pool.len;
+		if (fclose(f) || !ok || rename(tmp, path)) remove(tmp);
+	}
+	free(tmp);
+fail:
+	free(path);
+	free_buffer(&pool);
+	free_buffer(&nodes);
+	free_buffer(&forms);
+}
+
+/*
+	pool_string() checks a string offset from a page cache file and turns it into a pointer.
+	Every string in the pool ends with a null byte, which open_cached_page() has already checked for.
+*/
+static _Bool pool_string(const char* pool, uint32_t size, uint32_t offset, const char** str)
+{
+	if (offset == NO_STRING)
+	{
+		*str = NULL;
+		return true;
+	}
+	if (offset >= size) return false;
+	*str = pool + offset;
+	return true;
+}
+
+/*
+	close_cached_page() frees a page loaded from the page cache.
+*/
+static void close_cached_page(cached_page* page)
+{
+	for (size_t i = 0; i < page->count; ++i)
+	{
+		if (page->nodes[i].type == input) track_free(mem_text, page->nodes[i].field->entered);
+		if (page->nodes[i].type != image) continue;
+		lazy_image* img = page->nodes[i].image;
+		SDL_AtomicSet(&img->cancel.cancelled, 1);
+		if (img->loader) finish_image_load(img);
+		free_levels(img);
+	}
+	track_free(mem_nodes, page->nodes);
+	unmap_file(page->file);
+	*page = (cached_page){0};
+}
+
+/*
+	open_cached_page() loads a url's simplified page from the page cache, if there is a fresh one.
+	The file is mapped and checked, and then every node, form, field and image is laid out in a single allocation,
+	with text, links and field names pointing straight into the mapping. Only the page's own url is interned.
+	The page's images are added to page_images.
+*/
+static _Bool open_cached_page(const char* url, cached_page* page)
+{
+	*page = (cached_page){0};
+	char* path = page_cache_path(url, 0);
+	if (!path) return false;
+	struct stat st;
+	_Bool fresh = !stat(path, &st) && time(NULL) - st.st_mtime < page_cache_age; // The expiry time is checked once it is open
+	mapped_file f = fresh ? map_file(path) : (mapped_file){0};
+	free(path);
+	const page_header* h = f.data;
+	if (!f.data || f.size < sizeof *h || memcmp(h->magic, "ERPC", 4) || h->version != PAGE_CACHE_VERSION
+		|| h->expires <= time(NULL)
+		|| h->node_count > f.size / sizeof(packed_node) || h->image_count > h->node_count
+		|| h->form_count > h->node_count || h->field_count > h->node_count
+		|| sizeof *h + (size_t)h->node_count * sizeof(packed_node) + h->pool_size != f.size || !h->pool_size)
+		goto fail;
+	const packed_node* packed = (const packed_node*)(h + 1);
+	const char* pool = (const char*)(packed + h->node_count);
+	if (pool[h->pool_size - 1]) goto fail;
+	const char* cached_url;
+	if (!pool_string(pool, h->pool_size, h->url, &cached_url) || !cached_url || strcmp(cached_url, url)
+		|| !pool_string(pool, h->pool_size, h->final_url, &page->final_url) || !page->final_url
+		|| !pool_string(pool, h->pool_size, h->title, &page->title))
+		goto fail;
+
+	size_t bytes = h->node_count * sizeof(node) + h->form_count * sizeof(form) + h->field_count * sizeof(form_field)
+		+ h->image_count * sizeof(lazy_image);
+	page->file = f;
+	page->nodes = track_calloc(mem_nodes, 1, bytes ? bytes : 1);
+	form* forms = (form*)(page->nodes + h->node_count);
+	form_field* fields = (form_field*)(forms + h->form_count);
+	lazy_image* images = (lazy_image*)(fields + h->field_count);
+	size_t form_count = 0, field_count = 0, image_count = 0;
+	for (page->count = 0; page->count < h->node_count; ++page->count)
+	{
+		const packed_node* p = &packed[page->count];
+		node* n = &page->nodes[page->count];
+		n->type = p->type;
+		n->next = page->count + 1 < h->node_count ? n + 1 : NULL;
+		switch (p->type)
+		{
+			case text:
+				if (!pool_string(pool, h->pool_size, p->a, &n->text) || !n->text) goto fail;
+				break;
+			case hyperlink:
+				if (!pool_string(pool, h->pool_size, p->a, &n->text)) goto fail;
+				break;
+			case image:
+			{
+				const char* src;
+				if (image_count == h->image_count || !pool_string(pool, h->pool_size, p->a, &src) || !src) goto fail;
+				lazy_image* img = &images[image_count++];
+				img->src = src;
+				img->width = p->b;
+				img->height = p->c;
+				n->image = img;
+				break;
+			}
+			case form_start:
+			{
+				if (form_count == h->form_count) goto fail;
+				form* fm = &forms[form_count++];
+				if (p->b > post || p->c > multipart || !pool_string(pool, h->pool_size, p->a, &fm->action)) goto fail;
+				fm->method = p->b;
+				fm->enctype = p->c;
+				n->form = fm;
+				break;
+			}
+			case input:
+			{
+				if (field_count == h->field_count) goto fail;
+				form_field* field = &fields[field_count++];
+				if ((p->c & 0xff) > submit_field || p->c >> 8 >= form_count
+					|| !pool_string(pool, h->pool_size, p->a, &field->name)
+					|| !pool_string(pool, h->pool_size, p->b, &field->value))
+					goto fail;
+				field->kind = p->c & 0xff;
+				field->form = &forms[p->c >> 8];
+				n->field = field;
+				break;
+			}
+			case make_bold:
+			case remove_bold:
+			case make_italic:
+			case remove_italic:
+			case seperator:
+			case end_hyperlink:
+				break;
+			default:
+				goto fail;
+		}
+	}
+	page->final_url = intern(page->final_url);
+	// Going backwards, so adding each field to the front of its form leaves them in order.
+	for (size_t i = field_count; i-- > 0;)
+	{
+		fields[i].next = fields[i].form->fields;
+		fields[i].form->fields = &fields[i];
+	}
+	// Only now that the whole file checks out do the images join the page.
+	for (size_t i = image_count; i-- > 0;)
+	{
+		images[i].next = page_images;
+		page_images = &images[i];
+	}
+	return true;
+
+fail:
+	if (page->nodes) close_cached_page(page);
+	else unmap_file(f);
+	*page = (cached_page){0};
+	return false;
+}
+
+/*
+	same_page() compares two simplified pages node by node, for checking the page cache.
+*/
+static _Bool same_page(const node* a, const node* b)
+{
+	#define SAME_STRING(x, y) ((x) == (y) || ((x) && (y) && !strcmp((x), (y))))
+	for (; a && b; a = a->next, b = b->next)
+	{
+		if (a->type != b->type) return false;
+		switch (a->type)
+		{
+			case text:
+			case hyperlink:
+				if (!SAME_STRING(a->text, b->text)) return false;
+				break;
+			case image:
+				if (!SAME_STRING(a->image->src, b->image->src)
+					|| a->image->width != b->image->width || a->image->height != b->image->height)
+					return false;
+				break;
+			case form_start:
+				if (!SAME_STRING(a->form->action, b->form->action) || a->form->method != b->form->method
+					|| a->form->enctype != b->form->enctype)
+					return false;
+				break;
+			case input:
+				if (!SAME_STRING(a->field->name, b->field->name) || !SAME_STRING(a->field->value, b->field->value)
+					|| a->field->kind != b->field->kind)
+					return false;
+				break;
+			default:
+				break;
+		}
+	}
+	#undef SAME_STRING
+	return !a && !b;
+}
+
+/*
+	reopen_cached_page() reads back a page just written to the page cache and compares it with the one that was saved.
+	It returns 1 if they match, 0 if they don't, and -1 if there was no page to read back.
+*/
+static int reopen_cached_page(const char* url, const char* final_url, const node* page, const char* title)
+{
+	lazy_image* images = page_images;
+	cached_page copy;
+	if (!open_cached_page(url, &copy)) return -1;
+	_Bool same = same_page(page, copy.nodes) && !strcmp(copy.final_url, final_url)
+		&& (title ? copy.title && !strcmp(title, copy.title) : !copy.title);
+	page_images = images; // The copy's images mustn't stay on the page
+	close_cached_page(&copy);
+	return same;
+}
+
+/*
+	check_cached_page() checks a page just written to the page cache reads back the same.
+	It only runs in debug builds.
+*/
+static void check_cached_page(const char* url, const char* final_url, const node* page, const char* title)
+{
+#ifdef ERSATZ_DEBUG
+	if (!reopen_cached_page(url, final_url, page, title)) throw_error("Page cache round trip changed %s", url);
+#else
+	(void)url;
+	(void)final_url;
+	(void)page;
+	(void)title;
+#endif
+}
+
+/*
+	build_find_index() joins up the text of a page, lowercased, for find-in-page to search.
+	It runs once when the page loads.
+*/
+static void build_find_index(const node* page)
+{
+	size_t len = 0, count = 0;
+	for (const node* n = page; n; n = n->next)
+		if (n->type == text) len += strlen(n->text) + 1, count++;
+	finder.text = track_malloc(mem_text, len + 1);
+	finder.nodes = track_malloc(mem_text, (count + 1) * sizeof *finder.nodes);
+	finder.starts = track_malloc(mem_text, (count + 1) * sizeof *finder.starts);
+	finder.len = 0;
+	finder.node_count = 0;
+	for (const node* n = page; n; n = n->next)
+	{
+		if (n->type != text) continue;
+		finder.nodes[finder.node_count] = n;
+		finder.starts[finder.node_count++] = finder.len;
+		for (const char* s = n->text; *s; ++s) finder.text[finder.len++] = tolower((unsigned char)*s);
+		finder.text[finder.len++] = '\0'; // So a match never runs from one node into the next
+	}
+	finder.text[finder.len] = '\0';
+}
+
+/*
+	clear_find() stops finding, and forgets the matches.
+*/
+static void clear_find(void)
+{
+	track_free(mem_layout, finder.needle);
+	track_free(mem_layout, finder.matches);
+	finder.needle = NULL;
+	finder.needle_len = 0;
+	finder.matches = NULL;
+	finder.match_count = 0;
+	finder.current = 0;
+}
+
+/*
+	free_find_index() frees the find text of a page, along with anything found in it.
+*/
+static void free_find_index(void)
+{
+	clear_find();
+	track_free(mem_text, finder.text);
+	track_free(mem_text, finder.nodes);
+	track_free(mem_text, finder.starts);
+	finder = (find_state){0};
+}
+
+/*
+	search_text() finds the first place needle occurs in hay at or after from, or returns SIZE_MAX.
+	With SSE2, sixteen positions are tried at once by comparing the needle's first and last bytes,
+	and only positions where both match are compared in full.
+*/
+static size_t search_text(const char* hay, size_t len, const char* needle, size_t needle_len, size_t from)
+{
+	if (needle_len > len) return SIZE_MAX;
+	size_t last = len - needle_len; // The last position a match can start at
+	size_t i = from;
+#ifdef __SSE2__
+	const __m128i first_byte = _mm_set1_epi8(needle[0]);
+	const __m128i last_byte = _mm_set1_epi8(needle[needle_len - 1]);
+	for (; i + 15 <= last; i += 16)
+	{
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(hay + i)), first_byte);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(hay + i + needle_len - 1)), last_byte);
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+		for (; mask; mask &= mask - 1)
+		{
+			size_t at = i + __builtin_ctz(mask);
+			if (!memcmp(hay + at + 1, needle + 1, needle_len - 1)) return at;
+		}
+	}
+#endif
+	for (; i <= last; ++i)
+		if (hay[i] == needle[0] && !memcmp(hay + i + 1, needle + 1, needle_len - 1)) return i;
+	return SIZE_MAX;
+}
+
+/*
+	start_find() looks for a string all over the page, ignoring case, and remembers every match.
+	An empty string stops finding.
+*/
+static void start_find(const char* str)
+{
+	clear_find();
+	if (!str || !*str || !finder.text) return;
+	finder.needle_len = strlen(str);
+	finder.needle = track_malloc(mem_layout, finder.needle_len + 1);
+	for (size_t i = 0; i <= finder.needle_len; ++i) finder.needle[i] = tolower((unsigned char)str[i]);
+	size_t cap = 0;
+	for (size_t at = 0; (at = search_text(finder.text, finder.len, finder.needle, finder.needle_len, at)) != SIZE_MAX; at += finder.needle_len)
+	{
+		if (finder.match_count == cap)
+		{
+			cap = cap ? cap * 2 : 64;
+			finder.matches = track_realloc(mem_layout, finder.matches, cap * sizeof *finder.matches);
+		}
+		finder.matches[finder.match_count++] = at;
+	}
+}
+
+/*
+	jump_to_match() scrolls so the current match is a third of the way down the window.
+	Where it is depends on layout, so the whole page is laid out once, without drawing or loading anything.
+*/
+static void jump_to_match(const node* page)
+{
+	if (!finder.match_count) return;
+	int height = window_height, loads = image_loads, scroll = scroll_offset;
+	measuring = 1;
+	window_height = INT_MAX / 4;
+	image_loads = MAX_IMAGE_LOADS; // So request_image() never starts a loader
+	scroll_offset = 0;
+	plotter_x = MARGIN_WIDTH;
+	plotter_y = BAR_HEIGHT;
+	current_font = regular_font;
+	text_color = FGCOLOUR;
+	finder.current_y = INT_MIN;
+	render_simplified_html(page);
+	measuring = 0;
+	window_height = height;
+	image_loads = loads;
+	scroll_offset = scroll;
+	if (finder.current_y == INT_MIN) return;
+	scroll_offset = BAR_HEIGHT + (window_height - BAR_HEIGHT) / 3 - finder.current_y;
+	if (scroll_offset > 0) scroll_offset = 0;
+}
+
+/*
+	free_page() frees the current page's nodes and strings, however they were made.
+*/
+static void free_page(const node* page)
+{
+	clear_text_runs();
+	free_find_index();
+	if (current_cached.file.data) close_cached_page(&current_cached);
+	else dealloc_nodes(page);
+	free_intern_table(&page_strings);
+}
+
+/*
+	draw_field_text() draws what is in a form field, cut off at the edge of its box.
+	Password boxes show a star for each character.
+*/
+static void draw_field_text(_Bool secret, const char* str, SDL_Rect box, int char_width)
+{
+	size_t fits = box.w > 10 ? (box.w - 10) / char_width : 0;
+	size_t len = strlen(str);
+	if (len > fits) len = fits;
+	if (!len) return;
+	char* shown = secret ? memset(malloc(len + 1), '*', len) : memcpy(malloc(len + 1), str, len);
+	shown[len] = '\0';
+	SDL_Surface* surface = TTF_RenderUTF8_Blended(regular_font, shown, FGCOLOUR);
+	free(shown);
+	if (!surface) return;
+	draw_texture(SDL_CreateTextureFromSurface(renderer, surface),
+		(SDL_Rect){.x = box.x + 5, .y = box.y, .w = surface->w, .h = surface->h}, 1);
+	SDL_FreeSurface(surface);
+}
+
+/*
+	render_simplified_html() renders the simplified html data structure to the screen, including images.
+	It adds hyperlinks and forms to their global lists respectively.
+	It adjusts for scrolling.
+*/
+void render_simplified_html(const node* ptr)
+{
+	bool is_seperated = false;
+	int x, y, w, h;
+	const char* url; // hyperlink stuff
+	size_t find_node = 0, find_match = 0; // find-in-page stuff
+	// The boxes are found afresh every frame, so last frame's go first.
+	dealloc_forms(forms);
+	forms = NULL;
+	dealloc_links(hyperlinks);
+	hyperlinks = NULL;
+	for (; ptr ; ptr = ptr->next)
+	{
+		// Layout carries on past the bottom of the window, so images below it can be loaded or kept.
+		_Bool render = !measuring && plotter_y > -window_height && plotter_y <= window_height;
+		if (plotter_y > window_height + IMAGE_UNLOAD_DISTANCE) return;
+		switch (ptr->type)
+		{
+			case text:
+			{
+				// Text nodes come in the same order as in the find text, so their matches can be picked off as we go.
+				text_hits hits = {0}, *found = NULL;
+				if (finder.match_count && find_node < finder.node_count && finder.nodes[find_node] == ptr)
+				{
+					hits.base = finder.starts[find_node++];
+					size_t end = hits.base + strlen(ptr->text);
+					while (find_match < finder.match_count && finder.matches[find_match] < hits.base) find_match++;
+					hits.first = find_match;
+					hits.at = &finder.matches[find_match];
+					while (find_match < finder.match_count && finder.matches[find_match] < end) find_match++;
+					hits.count = find_match - hits.first;
+					if (hits.count) found = &hits;
+				}
+				render_text(ptr->text, renderer, current_font, render, found);
+			}
+			break;
+			case seperator:
+				if (!is_seperated)
+				{
+					plotter_y += TTF_FontHeight(regular_font) + 25;
+					plotter_x = MARGIN_WIDTH;
+					if (render)
+					{
+						draw_hline(SPCOLOUR, MARGIN_WIDTH/2, window_width - MARGIN_WIDTH/2, plotter_y);
+					}
+					plotter_y += 25;
+				}
+				break;
+			case make_bold:
+				current_font = bold_font;
+				break;
+			case make_italic:
+				current_font = italic_font;
+				break;
+			case remove_italic:
+			case remove_bold:
+				current_font = regular_font;
+				break;
+			case hyperlink:
+				x = plotter_x;
+				y = plotter_y;
+				url = ptr->text;
+				text_color = HLCOLOUR;
+				break;
+			case end_hyperlink:
+				if (render)
+				{
+					h = TTF_FontHeight(current_font);
+					w = plotter_x - x;
+					if (plotter_y > y)
+					{
+						// Multiline hyperlink
+						add_hyperlink(url, x, y, window_width - MARGIN_WIDTH - x, h);
+						if (plotter_y - h - y > 0) add_hyperlink(url, MARGIN_WIDTH, y + h, window_width - MARGIN_WIDTH, plotter_y - h - y);
+						add_hyperlink(url, MARGIN_WIDTH, plotter_y, plotter_x - MARGIN_WIDTH, h);
+					}
+					else add_hyperlink(url, x, y, w, h);
+				}
+				text_color = FGCOLOUR;
+				break;
+			case image:
+			{
+				if (plotter_x > MARGIN_WIDTH) plotter_y += TTF_FontHeight(current_font) + 10;
+				plotter_x = MARGIN_WIDTH;
+				lazy_image* img = ptr->image;
+				int image_width, image_height;
+				_Bool size_known = image_size(img, &image_width, &image_height);
+				if (image_width > (window_width - MARGIN_WIDTH*2))
+				{
+					image_height *= (window_width - MARGIN_WIDTH*2);
+					image_height /= image_width;
+					image_width = window_width - MARGIN_WIDTH*2;
+				}
+				if (plotter_y + image_height > -IMAGE_UNLOAD_DISTANCE && plotter_y < window_height + IMAGE_UNLOAD_DISTANCE)
+					img->last_near = frame_count;
+				if (plotter_y + image_height > -image_load_distance && plotter_y < window_height + image_load_distance)
+					request_image(img, size_known ? image_width : CONTENT_WIDTH);
+				if (render)
+				{
+					SDL_Rect rect = {MARGIN_WIDTH, plotter_y, image_width, image_height};
+					if (img->levels[0])
+					{
+						// Draw the smallest level that is still at least as wide as the image on screen.
+						int level = 0;
+						while (level + 1 < MIP_LEVELS && img->levels[level + 1] && img->levels[level + 1]->w >= image_width) level++;
+						if (!img->texture || img->texture_level != level)
 						{
-							char* name = (char*)xmlGetProp(ptr, (xmlChar*)"name");
-							char* type = (char*)xmlGetProp(ptr, (xmlChar*)"type");
-							if (type && strcmp(type, "text") && strcmp(type, "search"))
-							{
-								free(type);
-								free(name);
-								goto err;
-							}
-							free(type);
-							// Assume type is text because nobody actually uses checkboxes.
-							form* f = malloc(sizeof *f);
-							f->action = form_action;
-							f->name = name;
-							f->method = form_method;
-							head =
-								alloc_node(input, f,
-									simplify_html(ptr->last, head));
+							destroy_image_texture(img);
+							make_image_texture(img, level);
 						}
-						break;
+						draw_texture(img->texture, rect, 0);
+					}
+					else
+					{
+						// Placeholder until the pixels arrive
+						draw_prim_rect(outline_rect, SPCOLOUR, rect);
 					}
 				}
+				plotter_y += image_height + 10;
+			}
+			break;
+			case input:
+			{
+				form_field* field = ptr->field;
+				if (field->kind == hidden_field) break;
+				int height = TTF_FontHeight(regular_font);
+				if (plotter_x > MARGIN_WIDTH) plotter_y += height;
+				plotter_x = MARGIN_WIDTH;
+				if (render)
+				{
+					// Text boxes take the whole width, and buttons are as wide as their label.
+					const char* shown = field->kind == submit_field && !field->value ? "Submit" : field_value(field);
+					int char_width;
+					TTF_SizeUTF8(regular_font, "a", &char_width, NULL);
+					form_list* fl = track_malloc(mem_layout, sizeof *fl);
+					fl->field = field;
+					fl->next = forms;
+					fl->box.x = MARGIN_WIDTH;
+					fl->box.y = plotter_y + height/2;
+					fl->box.w = field->kind == submit_field ? (int)strlen(shown) * char_width + 20 : CONTENT_WIDTH;
+					fl->box.h = height;
+					forms = fl;
+					draw_prim_rect(outline_rect, FGCOLOUR, fl->box);
+					draw_field_text(field->kind == secret_field, shown, fl->box, char_width);
+				}
+				plotter_y += height * 2;
+			}
+			break;
+			default:
+			break;
+		}
+		if (ptr->type == seperator) is_seperated = true;
+		else is_seperated = false;
+	}
+}
+
+/*
+	new_curl_handle() makes a curl handle with our usual options.
+*/
+static CURL* new_curl_handle(void)
+{
+	CURL* handle = curl_easy_init();
+	curl_easy_setopt(handle, CURLOPT_USERAGENT, "Ersatz/0.0.1");
+	//curl_easy_setopt(handle, CURLOPT_PROGRESSFUNCTION, progress_bar);
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);		 // Disable the progress bar
+	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L); // Follow redirects
+	curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, ""); // Offer every encoding curl supports (gzip, deflate, br, zstd)
+	return handle;
+}
+
+/*
+	init_curl() inits curl innit.
+*/
+static void init_curl(void)
+{
+	curl_global_init(CURL_GLOBAL_ALL);
+	curl_handle = new_curl_handle();
+}
+
+/*
+	init_sdl() inits sdl innit.
+	Only video (and with it events) is needed. Image codecs are loaded when the first image of each type turns up.
+*/
+static void init_sdl(void)
+{
+	if (SDL_Init(SDL_INIT_VIDEO)) throw_error("Failed to initialise the SDL window");
+	if (TTF_Init()) throw_error("Failed to initialise SDL_TTF");
+	trace_startup("sdl init");
+	window = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, window_width, window_height, SDL_WINDOW_RESIZABLE);
+	if (!cpu_render) renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+	if (!renderer) renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+	SDL_RendererInfo info;
+	if (!renderer || SDL_GetRendererInfo(renderer, &info)) throw_error("Failed to create a renderer: %s", SDL_GetError());
+	// Without a GPU, the software renderer draws into the window surface, which we can then draw into too.
+	cpu_render = info.flags & SDL_RENDERER_SOFTWARE;
+	SDL_Surface* surface = cpu_render ? SDL_GetWindowSurface(window) : NULL;
+	cpu_glyphs = surface && (surface->format->format == SDL_PIXELFORMAT_RGB888 || surface->format->format == SDL_PIXELFORMAT_ARGB8888);
+	trace_startup("window");
+}
+
+/*
+	open_font() opens a font at a size from a mapped file.
+*/
+static TTF_Font* open_font(mapped_file f, int size)
+{
+	TTF_Font* font = TTF_OpenFontRW(SDL_RWFromConstMem(f.data, f.size), 1, size);
+	if (!font) throw_error("Failed to open font: %s", SDL_GetError());
+	return font;
+}
+
+/*
+	init_fonts() inits fonts innit.
+	Each file is mapped once, and the regular one is shared by the body and menu sizes.
+*/
+static void init_fonts(void)
+{
+	regular_font_file = map_data_file("iosevka-term-regular.ttf");
+	bold_font_file    = map_data_file("iosevka-term-bold.ttf");
+	italic_font_file  = map_data_file("iosevka-term-italic.ttf");
+	regular_font = open_font(regular_font_file, TEXT_FONT_SIZE);
+	menu_font    = open_font(regular_font_file, MENU_FONT_SIZE);
+	bold_font    = open_font(bold_font_file, TEXT_FONT_SIZE);
+	italic_font  = open_font(italic_font_file, TEXT_FONT_SIZE);
+	current_font = regular_font;
+	text_color = FGCOLOUR;
+	trace_startup("fonts");
+}
+
+/*
+	init_cursors() inits cursors innit.
+*/
+static void init_cursors(void)
+{
+	default_cursor = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_ARROW);
+	loading_cursor = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_WAIT);
+}
+
+/*
+	parse_args() initialises colours and the url from commandline arguments.
+*/
+void parse_args(int argc, char** argv)
+{
+	for (int i = 1 ; i < argc ; ++i)
+	{
+		// I was originally using regular expressions, but sscnf works much better.
+		int success = 0;
+		sscanf(argv[i], "--bg=#%2x%2x%2x%n", &bg_r, &bg_g, &bg_b, &success);
+		sscanf(argv[i], "--fg=#%2x%2x%2x%n", &fg_r, &fg_g, &fg_b, &success);
+		sscanf(argv[i], "--hl=#%2x%2x%2x%n", &hl_r, &hl_g, &hl_b, &success);
+		sscanf(argv[i], "--sp=#%2x%2x%2x%n", &sp_r, &sp_g, &sp_b, &success);
+		if (!strncmp("--url=", argv[i], 6)) current_url = argv[i] + 6, success++;
+		sscanf(argv[i], "--img-distance=%d%n", &image_load_distance, &success);
+		sscanf(argv[i], "--cache-age=%d%n", &page_cache_age, &success);
+		if (!strncmp("--bench=", argv[i], 8)) bench_file = argv[i] + 8, success++;
+		if (!strcmp(argv[i], "--cache-check")) cache_check = 1, success++;
+		if (!strcmp(argv[i], "--startup-trace")) startup_trace = 1, success++;
+		if (!strcmp(argv[i], "--cpu-render")) cpu_render = 1, success++;
+		if (!strcmp(argv[i], "--no-history")) history_indexing = 0, success++;
+		if (!strncmp("--record=", argv[i], 9)) record_file = argv[i] + 9, success++;
+		if (!strncmp("--replay=", argv[i], 9)) replay_file = argv[i] + 9, success++;
+		if (!strcmp(argv[i], "--headless")) headless = 1, success++;
+		if (!strcmp(argv[i], "--png")) headless_png = 1, success++;
+		if (!strcmp(argv[i], "--text")) headless_text = 1, success++;
+		if (!strncmp("--out=", argv[i], 6)) headless_dir = argv[i] + 6, success++;
+		sscanf(argv[i], "--jobs=%d%n", &headless_jobs, &success);
+		sscanf(argv[i], "--width=%d%n", &window_width, &success);
+		// Anything else that isn't an option is a page to render headlessly.
+		if (argv[i][0] != '-')
+		{
+			headless_pages = realloc(headless_pages, (headless_count + 1) * sizeof *headless_pages);
+			headless_pages[headless_count++] = (headless_page){.url = argv[i]};
+			success++;
+		}
+		if (!success) throw_error("invalid argument");
+	}
+	if (headless_count && !headless) throw_error("pages can only be listed with --headless");
+	if (record_file && replay_file) throw_error("--record and --replay can't be used together");
+	if (!headless_png && !headless_text) headless_png = 1;
+}
+
+/*
+	headless_worker() is the body of a headless worker thread.
+	Each worker takes the next page off the list, fetches, parses and simplifies it, and loads its images.
+	Layout and drawing use global state, so the main thread does those in order as pages become ready.
+*/
+static int headless_worker(void* ptr)
+{
+	(void)ptr;
+	CURL* handle = new_curl_handle();
+	for (;;)
+	{
+		int i = SDL_AtomicAdd(&headless_next, 1);
+		if (i >= headless_count) break;
+		headless_page* p = &headless_pages[i];
+		char* final_url;
+		char error[CURL_ERROR_SIZE];
+		request req = {.url = p->url, .method = get};
+		parsed_page page = {0};
+		if (!load_page(handle, &req, &p->stats, NULL, &page, &final_url, error)) page = (parsed_page){.nodes = error_page(p->url, error)};
+		const char* effective_url = intern(final_url);
+		free(final_url);
+		p->nodes = page.nodes;
+		p->images = page.images;
+		p->strings = page.strings;
+		if (headless_png)
+			for (lazy_image* img = p->images; img; img = img->next)
+				load_image_now(img, &p->strings, effective_url, CONTENT_WIDTH);
+		SDL_LockMutex(headless_lock);
+		p->done = 1;
+		SDL_CondBroadcast(headless_ready);
+		SDL_UnlockMutex(headless_lock);
+	}
+	curl_easy_cleanup(handle);
+	return 0;
+}
+
+/*
+	write_headless_png() lays a page out at full length and draws it to a PNG with a software renderer.
+*/
+static void write_headless_png(const headless_page* p, const char* path)
+{
+	// The first pass just measures the page.
+	measuring = 1;
+	window_height = INT_MAX / 4;
+	plotter_x = MARGIN_WIDTH;
+	plotter_y = 10;
+	current_font = regular_font;
+	text_color = FGCOLOUR;
+	render_simplified_html(p->nodes);
+	measuring = 0;
+	int height = plotter_y + TTF_FontHeight(regular_font) + 10;
+	if (height > HEADLESS_MAX_HEIGHT) height = HEADLESS_MAX_HEIGHT;
+
+	// The second draws it, with the whole page as the window.
+	window_height = height;
+	SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, window_width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+	if (!surface) throw_error("Cannot make a %ix%i surface", window_width, height);
+	renderer = SDL_CreateSoftwareRenderer(surface);
+	SDL_SetRenderDrawColor(renderer, bg_r, bg_g, bg_b, 255);
+	SDL_RenderClear(renderer);
+	plotter_x = MARGIN_WIDTH;
+	plotter_y = 10;
+	current_font = regular_font;
+	text_color = FGCOLOUR;
+	render_simplified_html(p->nodes);
+	flush_draws();
+	SDL_RenderPresent(renderer);
+	if (IMG_SavePNG(surface, path)) fprintf(stderr, "Cannot write %s: %s\n", path, SDL_GetError());
+	// Image textures belong to this renderer, so they go before it does.
+	for (lazy_image* img = p->images; img; img = img->next) destroy_image_texture(img);
+	SDL_DestroyRenderer(renderer);
+	renderer = NULL;
+	SDL_FreeSurface(surface);
+	dealloc_forms(forms);
+	forms = NULL;
+	dealloc_links(hyperlinks);
+	hyperlinks = NULL;
+	clear_text_runs();
+}
+
+/*
+	run_headless() renders every page given on the command line to files, without a window.
+	Pages are fetched and simplified on a pool of workers, and written out in order.
+*/
+static int run_headless(void)
+{
+	if (TTF_Init()) throw_error("Failed to initialise SDL_TTF");
+	init_fonts();
+	if (headless_jobs <= 0) headless_jobs = SDL_GetCPUCount();
+	headless_lock = SDL_CreateMutex();
+	headless_ready = SDL_CreateCond();
+	Uint64 start = SDL_GetPerformanceCounter();
+	SDL_Thread** workers = malloc(headless_jobs * sizeof *workers);
+	for (int i = 0; i < headless_jobs; ++i) workers[i] = SDL_CreateThread(headless_worker, "headless worker", NULL);
+	curl_off_t wire_bytes = 0;
+	for (int i = 0; i < headless_count; ++i)
+	{
+		headless_page* p = &headless_pages[i];
+		SDL_LockMutex(headless_lock);
+		while (!p->done) SDL_CondWait(headless_ready, headless_lock);
+		SDL_UnlockMutex(headless_lock);
+		char path[PATH_MAX];
+		if (headless_png)
+		{
+			snprintf(path, sizeof path, "%s/page%i.png", headless_dir, i);
+			write_headless_png(p, path);
+		}
+		if (headless_text)
+		{
+			snprintf(path, sizeof path, "%s/page%i.txt", headless_dir, i);
+			FILE* out = fopen(path, "w");
+			if (!out) throw_error("Cannot write %s", path);
+			print_simplified_html(p->nodes, out);
+			fclose(out);
+		}
+		wire_bytes += p->stats.wire_bytes;
+		dealloc_nodes(p->nodes);
+		free_intern_table(&p->strings);
+	}
+	for (int i = 0; i < headless_jobs; ++i) SDL_WaitThread(workers[i], NULL);
+	double seconds = (SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+	fprintf(stderr, "Rendered %i pages in %.2fs with %i workers (%.2f pages/sec, %" CURL_FORMAT_CURL_OFF_T " bytes fetched)\n",
+		headless_count, seconds, headless_jobs, headless_count / seconds, wire_bytes);
+	free(workers);
+	free(headless_pages);
+	SDL_DestroyCond(headless_ready);
+	SDL_DestroyMutex(headless_lock);
+	close_fallback_fonts();
+	TTF_Quit();
+	curl_easy_cleanup(curl_handle);
+	return EXIT_SUCCESS;
+}
+
+/*
+	convert_html() runs a document held in memory through everything short of drawing it:
+	parsing, simplifying, and laying it out at full length. Nothing is fetched.
+	It is what the fuzzer and --bench exercise.
+*/
+static void convert_html(const char* data, size_t size)
+{
+	if (size > INT_MAX) return;
+	xmlSubstituteEntitiesDefault(true);
+	parsed_page page = parse_html(data, size, "file:///ersatz/convert.html",
+		HTML_PARSE_NOBLANKS | HTML_PARSE_NONET | HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING);
+
+	int height = window_height, loads = image_loads;
+	measuring = 1;
+	window_height = INT_MAX / 4;
+	image_loads = MAX_IMAGE_LOADS; // So request_image() never starts a loader
+	plotter_x = MARGIN_WIDTH;
+	plotter_y = 10;
+	current_font = regular_font;
+	text_color = FGCOLOUR;
+	render_simplified_html(page.nodes);
+	measuring = 0;
+	window_height = height;
+	image_loads = loads;
+
+	clear_text_runs();
+	free_parsed_page(&page);
+	dealloc_forms(forms);
+	forms = NULL;
+	dealloc_links(hyperlinks);
+	hyperlinks = NULL;
+}
+
+/*
+	run_bench() converts the page in bench_file over and over for a few seconds,
+	and prints how many megabytes of HTML a second it got through.
+*/
+static int run_bench(void)
+{
+	mapped_file f = map_file(bench_file);
+	if (!f.data) throw_error("Cannot read %s", bench_file);
+	if (TTF_Init()) throw_error("Failed to initialise SDL_TTF");
+	init_fonts();
+	convert_html(f.data, f.size); // Warm up the caches and the intern table
+	Uint64 start = SDL_GetPerformanceCounter(), now = start;
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	long runs = 0;
+	for (; runs < 10 || now - start < freq * 3; ++runs, now = SDL_GetPerformanceCounter())
+		convert_html(f.data, f.size);
+	double seconds = (double)(now - start) / freq;
+	printf("%ld runs of %zu bytes in %.2fs: %.2f MB/s, %.3f ms a run\n",
+		runs, f.size, seconds, f.size * runs / seconds / 1e6, seconds * 1000 / runs);
+	unmap_file(f);
+	return EXIT_SUCCESS;
+}
+
+/*
+	run_cache_check() saves a page with every kind of node to a page cache in a new directory, reads it back,
+	and checks it is the same. It also checks a page that mustn't be cached isn't. It is what 'make check' runs.
+*/
+static int run_cache_check(void)
+{
+	static const char html[] =
+		"<html><head><title>Cache check</title></head><body>"
+		"<h1>Heading</h1><p>Some <b>bold</b> and <i>italic</i> text, and <a href=\"/next\">a link</a>.</p>"
+		"<img src=\"picture.png\" width=\"40\" height=\"30\"><hr>"
+		"<form action=\"/search\" method=\"post\" enctype=\"multipart/form-data\">"
+		"<input name=\"q\" value=\"words\"><input type=\"hidden\" name=\"token\" value=\"abc\">"
+		"<input type=\"password\" name=\"secret\"><input type=\"submit\" name=\"go\" value=\"Go\"></form>"
+		"</body></html>";
+	const char* url = intern("http://cache-check.invalid/page");
+	const char* uncached_url = intern("http://cache-check.invalid/no-store");
+	char dir[] = "/tmp/ersatz-cache-check-XXXXXX";
+	if (!mkdtemp(dir)) throw_error("Cannot make a directory for the cache check");
+	setenv("XDG_CACHE_HOME", dir, 1);
+	if (!page_cache_age) page_cache_age = 600;
+
+	xmlSubstituteEntitiesDefault(true);
+	parsed_page page = parse_html(html, sizeof html - 1, url, HTML_PARSE_NOBLANKS | HTML_PARSE_NONET);
+	save_cached_page(url, url, page.nodes, page.title, 60);
+	save_cached_page(uncached_url, uncached_url, page.nodes, page.title, 0);
+	int saved = reopen_cached_page(url, url, page.nodes, page.title);
+	int uncached = reopen_cached_page(uncached_url, uncached_url, page.nodes, page.title);
+	free_parsed_page(&page);
+
+	char* path = page_cache_path(url, 0);
+	remove(path);
+	free(path);
+	char* cache_dir = page_cache_path(url, 0);
+	*strrchr(cache_dir, '/') = '\0';
+	rmdir(cache_dir);
+	rmdir(dir);
+	free(cache_dir);
+
+	if (saved < 0) printf("cache check: the page wasn't saved\n");
+	if (!saved) printf("cache check: the page changed on the way through the cache\n");
+	if (uncached >= 0) printf("cache check: a page that mustn't be cached was\n");
+	if (saved != 1 || uncached >= 0) return EXIT_FAILURE;
+	printf("cache check: passed\n");
+	return EXIT_SUCCESS;
+}
+
+/*
+	start_session() opens the file a session is recorded to or replayed from. A replay starts with the window
+	the size it was when recording started, so it has to be called before init_sdl().
+*/
+static void start_session(void)
+{
+	if (record_file)
+	{
+		recording = fopen(record_file, "wb");
+		session_header h = {.magic = "ERIR", .version = SESSION_VERSION, .event_size = sizeof(SDL_Event),
+			.width = window_width, .height = window_height};
+		if (!recording || fwrite(&h, sizeof h, 1, recording) != 1) throw_error("Cannot write %s", record_file);
+	}
+	if (replay_file)
+	{
+		replaying = map_file(replay_file);
+		const session_header* h = replaying.data;
+		if (!h || replaying.size < sizeof *h || memcmp(h->magic, "ERIR", 4) || h->version != SESSION_VERSION
+			|| h->event_size != sizeof(SDL_Event) || (replaying.size - sizeof *h) % sizeof(recorded_event))
+			throw_error("%s isn't a session recorded by this build", replay_file);
+		window_width = h->width;
+		window_height = h->height;
+		// The history is left as it was, and indexing doesn't compete with the replay.
+		history_indexing = 0;
+		if (replaying.size > sizeof *h) replay_idle = ((const recorded_event*)(h + 1))->idle;
+	}
+}
+
+/*
+	replayed_event() is next_event() for a replay. Events are handed to the loop that took them when recording,
+	after it has found nothing as many times as it did then, so the main loop draws the same frames between them.
+	Events taken while a page loaded are dropped if the page loads sooner this time, and a load that takes longer
+	just waits. Real input is thrown away, except for closing the window.
+*/
+static _Bool replayed_event(event_site site, SDL_Event* e, int timeout)
+{
+	const recorded_event* events = (const recorded_event*)((const session_header*)replaying.data + 1);
+	size_t count = (replaying.size - sizeof(session_header)) / sizeof(recorded_event);
+	for (;;)
+	{
+		SDL_PumpEvents();
+		_Bool quit = SDL_HasEvent(SDL_QUIT); // Which includes quits put back by our own loops
+		SDL_FlushEvents(SDL_FIRSTEVENT, SDL_LASTEVENT);
+		if (quit || replay_next == count)
+		{
+			// Once the events run out, the session is over.
+			if (!quit && site == event_prompt) throw_error("%s ends in the middle of typing", replay_file);
+			*e = (SDL_Event){.type = SDL_QUIT};
+			return 1;
+		}
+		const recorded_event* r = &events[replay_next];
+		if (r->site == event_load && site != event_load)
+		{
+			// The page loaded before this event was taken, so it has nothing to do.
+			replay_next++;
+			replay_idle = replay_next < count ? events[replay_next].idle : 0;
+			continue;
+		}
+		if (r->site != site && site != event_load)
+			throw_error("%s is out of step after %zu events: it expects another loop to take the next", replay_file, replay_next);
+		if (r->site != site || (replay_idle && timeout >= 0))
+		{
+			if (r->site == site) replay_idle--;
+			if (timeout > 0) SDL_Delay(timeout);
+			return 0;
+		}
+		*e = r->event;
+		replay_next++;
+		replay_idle = replay_next < count ? events[replay_next].idle : 0;
+		// The window goes back to the size it was, so the page is laid out the same.
+		if (e->type == SDL_WINDOWEVENT && site != event_prompt
+			&& (e->window.event == SDL_WINDOWEVENT_RESIZED || e->window.event == SDL_WINDOWEVENT_SIZE_CHANGED))
+			SDL_SetWindowSize(window, e->window.data1, e->window.data2);
+		return 1;
+	}
+}
+
+/*
+	next_event() takes the next input event for one of the loops, waiting for up to timeout milliseconds,
+	or forever if it is negative. It returns 0 if there wasn't one.
+	When recording, every event is written down, along with how many times the loop found nothing since the last one.
+	When replaying, the recorded events are handed out instead.
+*/
+static _Bool next_event(event_site site, SDL_Event* e, int timeout)
+{
+	static uint32_t idle[EVENT_SITES];
+	if (replay_file) return replayed_event(site, e, timeout);
+	_Bool got = timeout < 0 ? SDL_WaitEvent(e) : timeout ? SDL_WaitEventTimeout(e, timeout) : SDL_PollEvent(e);
+	if (!recording) return got;
+	if (!got)
+	{
+		idle[site]++;
+		return 0;
+	}
+	recorded_event r = {.site = site, .idle = idle[site], .event = *e,
+		.ms = (SDL_GetPerformanceCounter() - startup_time) * 1000 / SDL_GetPerformanceFrequency()};
+	// Pointers mean nothing in another run, and none of the events that carry them are used.
+	switch (e->type)
+	{
+		case SDL_DROPFILE:
+		case SDL_DROPTEXT:
+			r.event.drop.file = NULL;
+			break;
+		case SDL_SYSWMEVENT:
+			r.event.syswm.msg = NULL;
+			break;
+		default:
+			if (e->type >= SDL_USEREVENT) r.event.user.data1 = r.event.user.data2 = NULL;
+			break;
+	}
+	if (fwrite(&r, sizeof r, 1, recording) != 1 || fflush(recording)) throw_error("Cannot write %s", record_file);
+	memset(idle, 0, sizeof idle);
+	return 1;
+}
+
+/*
+	add_time() adds how long something took, since start, to a list of times for the replay report.
+*/
+static void add_time(float** times, size_t* count, Uint64 start)
+{
+	if (!replay_file) return;
+	// The list grows whenever count is one less than a power of two.
+	if (!(*count & (*count + 1))) *times = realloc(*times, (*count * 2 + 1) * sizeof **times);
+	(*times)[(*count)++] = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+/*
+	compare_times() orders times for qsort(), shortest first.
+*/
+static int compare_times(const void* a, const void* b)
+{
+	float x = *(const float*)a, y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+	print_times() prints the percentiles of a list of times, sorting them as it goes.
+*/
+static void print_times(const char* what, float* times, size_t count)
+{
+	if (!count)
+	{
+		printf("%s: none\n", what);
+		return;
+	}
+	qsort(times, count, sizeof *times, compare_times);
+	#define PERCENTILE(p) times[(count - 1) * (p) / 100]
+	printf("%s: %zu, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		what, count, PERCENTILE(50), PERCENTILE(90), PERCENTILE(99), times[count - 1]);
+	#undef PERCENTILE
+}
+
+/*
+	end_session() closes the session file. At the end of a replay, it prints how long frames and page loads took,
+	and the most memory the process had resident, so runs of different builds can be compared.
+*/
+static void end_session(void)
+{
+	if (recording) fclose(recording);
+	recording = NULL;
+	if (!replay_file) return;
+	unmap_file(replaying);
+	replaying = (mapped_file){0};
+	for (size_t i = 0; i < load_time_count; ++i) printf("load %zu: %.2f ms\n", i + 1, load_times[i]);
+	print_times("frames", frame_times, frame_time_count);
+	print_times("loads", load_times, load_time_count);
+	struct rusage usage;
+	if (!getrusage(RUSAGE_SELF, &usage)) printf("peak rss: %.1f MB\n", usage.ru_maxrss / 1024.0);
+	free(frame_times);
+	free(load_times);
+}
+
+#ifdef ERSATZ_FUZZ
+/*
+	LLVMFuzzerInitialize() and LLVMFuzzerTestOneInput() are the entry points for libFuzzer, built by 'make fuzz'.
+	libFuzzer brings its own main(), so ours is renamed out of the way.
+*/
+int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+	(void)argc;
+	(void)argv;
+	if (TTF_Init()) throw_error("Failed to initialise SDL_TTF");
+	init_fonts();
+	page_cache_age = 0;
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	convert_html((const char*)data, size);
+	return 0;
+}
+#define main ersatz_main
+#endif
+
+/*
+	draw_memory_overlay() draws the memory counters in the bottom corner of the window.
+*/
+static void draw_memory_overlay(void)
+{
+	int line = TTF_FontHeight(menu_font);
+	int y = window_height - line * MEM_SUBSYSTEMS - 10;
+	draw_prim_rect(fill_rect, BGCOLOUR, (SDL_Rect){.x = 0, .y = y - 5, .w = 330, .h = line * MEM_SUBSYSTEMS + 15});
+	draw_prim_rect(outline_rect, SPCOLOUR, (SDL_Rect){.x = 0, .y = y - 5, .w = 330, .h = line * MEM_SUBSYSTEMS + 15});
+	for (int s = 0; s < MEM_SUBSYSTEMS; ++s, y += line)
+	{
+		char str[64];
+		snprintf(str, sizeof str, "%-9s %7d KiB %6d", mem_names[s], SDL_AtomicGet(&mem_bytes[s]) / 1024, SDL_AtomicGet(&mem_blocks[s]));
+		SDL_Surface* surface = TTF_RenderUTF8_Blended(menu_font, str, FGCOLOUR);
+		if (!surface) continue;
+		draw_texture(SDL_CreateTextureFromSurface(renderer, surface), (SDL_Rect){.x = 5, .y = y, .w = surface->w, .h = surface->h}, 1);
+		SDL_FreeSurface(surface);
+	}
+	flush_draws();
+}
+
+/*
+	qoi_encode() compresses RGBA32 pixels in the QOI image format (https://qoiformat.org).
+	Screens of text are mostly long runs of one colour, which QOI squashes well at very little cost.
+*/
+static buffer qoi_encode(const uint8_t* px, int w, int h)
+{
+	size_t count = (size_t)w * h;
+	buffer b = {.data = malloc(14 + count * 5 + 8), .len = 0};
+	uint8_t* out = (uint8_t*)b.data;
+	size_t n = 0;
+	const uint8_t header[14] = {'q', 'o', 'i', 'f', w >> 24, w >> 16, w >> 8, w, h >> 24, h >> 16, h >> 8, h, 4, 0};
+	memcpy(out, header, 14);
+	n = 14;
+	uint8_t index[64][4] = {{0}};
+	uint8_t prev[4] = {0, 0, 0, 255};
+	int run = 0;
+	for (size_t i = 0; i < count; ++i, px += 4)
+	{
+		if (!memcmp(px, prev, 4))
+		{
+			if (++run == 62 || i + 1 == count)
+			{
+				out[n++] = 0xc0 | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run)
+		{
+			out[n++] = 0xc0 | (run - 1);
+			run = 0;
+		}
+		int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+		if (!memcmp(index[hash], px, 4))
+			out[n++] = hash;
+		else
+		{
+			memcpy(index[hash], px, 4);
+			if (px[3] == prev[3])
+			{
+				int8_t dr = px[0] - prev[0], dg = px[1] - prev[1], db = px[2] - prev[2];
+				int8_t dr_dg = dr - dg, db_dg = db - dg;
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+					out[n++] = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+				else if (dr_dg >= -8 && dr_dg <= 7 && dg >= -32 && dg <= 31 && db_dg >= -8 && db_dg <= 7)
+				{
+					out[n++] = 0x80 | (dg + 32);
+					out[n++] = (dr_dg + 8) << 4 | (db_dg + 8);
+				}
+				else
+				{
+					out[n++] = 0xfe;
+					memcpy(out + n, px, 3);
+					n += 3;
+				}
+			}
+			else
+			{
+				out[n++] = 0xff;
+				memcpy(out + n, px, 4);
+				n += 4;
+			}
+		}
+		memcpy(prev, px, 4);
+	}
+	memcpy(out + n, (const uint8_t[8]){0, 0, 0, 0, 0, 0, 0, 1}, 8);
+	b.len = b.cap = n + 8;
+	b.data = realloc(b.data, b.len);
+	return b;
+}
+
+/*
+	qoi_decode() turns QOI data made by qoi_encode() back into an RGBA32 surface.
+*/
+static SDL_Surface* qoi_decode(const uint8_t* in, size_t size)
+{
+	if (size < 22 || memcmp(in, "qoif", 4)) return NULL;
+	int w = in[4] << 24 | in[5] << 16 | in[6] << 8 | in[7];
+	int h = in[8] << 24 | in[9] << 16 | in[10] << 8 | in[11];
+	SDL_Surface* s = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32);
+	if (!s) return NULL;
+	uint8_t index[64][4] = {{0}};
+	uint8_t px[4] = {0, 0, 0, 255};
+	size_t p = 14, end = size - 8;
+	int run = 0;
+	for (int y = 0; y < h; ++y)
+	{
+		uint8_t* row = (uint8_t*)s->pixels + y * s->pitch;
+		for (int x = 0; x < w; ++x, row += 4)
+		{
+			if (run) --run;
+			else if (p < end)
+			{
+				uint8_t op = in[p++];
+				if (op == 0xfe && p + 3 <= end) memcpy(px, in + p, 3), p += 3;
+				else if (op == 0xff && p + 4 <= end) memcpy(px, in + p, 4), p += 4;
+				else if ((op & 0xc0) == 0x00) memcpy(px, index[op], 4);
+				else if ((op & 0xc0) == 0x40)
+				{
+					px[0] += ((op >> 4) & 3) - 2;
+					px[1] += ((op >> 2) & 3) - 2;
+					px[2] += (op & 3) - 2;
+				}
+				else if ((op & 0xc0) == 0x80 && p < end)
+				{
+					int dg = (op & 0x3f) - 32, b = in[p++];
+					px[0] += dg - 8 + (b >> 4);
+					px[1] += dg;
+					px[2] += dg - 8 + (b & 15);
+				}
+				else if ((op & 0xc0) == 0xc0) run = op & 0x3f;
+				memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+			}
+			memcpy(row, px, 4);
+		}
+	}
+	return s;
+}
+
+/*
+	take_snapshot() captures the page's part of the window, scrolled as it is now.
+	Whatever was presented last is gone, so the page is drawn again without presenting it and read back.
+*/
+static snapshot* take_snapshot(const node* page)
+{
+	int h = window_height - BAR_HEIGHT;
+	if (h <= 0 || window_width <= 0) return NULL;
+	uint8_t* px = malloc((size_t)window_width * h * 4);
+	SDL_SetRenderDrawColor(renderer, bg_r, bg_g, bg_b, 255);
+	SDL_RenderClear(renderer);
+	plotter_x = MARGIN_WIDTH;
+	plotter_y = scroll_offset + BAR_HEIGHT;
+	render_simplified_html(page);
+	flush_draws();
+	SDL_Rect area = {.x = 0, .y = BAR_HEIGHT, .w = window_width, .h = h};
+	snapshot* snap = NULL;
+	if (!SDL_RenderReadPixels(renderer, &area, SDL_PIXELFORMAT_RGBA32, px, window_width * 4))
+	{
+		snap = track_malloc(mem_history, sizeof *snap);
+		*snap = (snapshot){.w = window_width, .h = h, .scroll_offset = scroll_offset, .qoi = qoi_encode(px, window_width, h)};
+		snap->size = snap->qoi.len;
+		tracked(mem_history, snap->qoi.data);
+	}
+	free(px);
+	return snap;
+}
+
+/*
+	free_snapshot() frees a snapshot, in memory or on disk.
+*/
+static void free_snapshot(snapshot* snap)
+{
+	if (!snap) return;
+	if (!snap->qoi.data && snap->size && !--spilled_snapshots)
+	{
+		fclose(spill_file);
+		spill_file = NULL;
+	}
+	track_free(mem_history, snap->qoi.data);
+	track_free(mem_history, snap);
+}
+
+/*
+	trim_snapshots() keeps the newest snapshots in memory, up to SNAPSHOT_MEMORY_CAP bytes, and appends the rest to
+	spill_file. If a snapshot can't be spilled it is just dropped.
+*/
+static void trim_snapshots(void)
+{
+	size_t kept = 0;
+	for (const url_list* l = history; l; l = l->next)
+	{
+		snapshot* snap = l->snap;
+		if (!snap || !snap->qoi.data) continue;
+		if (kept + snap->size <= SNAPSHOT_MEMORY_CAP)
+		{
+			kept += snap->size;
+			continue;
+		}
+		if (!spill_file) spill_file = tmpfile();
+		if (spill_file && !fseek(spill_file, 0, SEEK_END) && (snap->spill_at = ftell(spill_file)) >= 0
+			&& fwrite(snap->qoi.data, 1, snap->size, spill_file) == snap->size)
+			spilled_snapshots++;
+		else snap->size = 0;
+		track_free(mem_history, snap->qoi.data);
+		snap->qoi = (buffer){0};
+	}
+}
+
+/*
+	snapshot_surface() decodes a snapshot, reading it back from disk if it was spilled.
+*/
+static SDL_Surface* snapshot_surface(const snapshot* snap)
+{
+	if (!snap || !snap->size) return NULL;
+	if (snap->qoi.data) return qoi_decode((const uint8_t*)snap->qoi.data, snap->size);
+	uint8_t* data = malloc(snap->size);
+	SDL_Surface* s = NULL;
+	if (!fseek(spill_file, snap->spill_at, SEEK_SET) && fread(data, 1, snap->size, spill_file) == snap->size)
+		s = qoi_decode(data, snap->size);
+	free(data);
+	return s;
+}
+
+/*
+	leave_page() records what the current page looks like before navigating away from it.
+*/
+static void leave_page(const node* page)
+{
+	url_list* l = (url_list*)history;
+	if (!l) return;
+	free_snapshot(l->snap);
+	l->snap = take_snapshot(page);
+	trim_snapshots();
+}
+
+/*
+	set_backdrop() makes a snapshot the backdrop, so there is something to look at while its page loads.
+	NULL clears it.
+*/
+static void set_backdrop(const snapshot* snap)
+{
+	SDL_DestroyTexture(backdrop);
+	backdrop = NULL;
+	SDL_Surface* s = snapshot_surface(snap);
+	if (!s) return;
+	backdrop = SDL_CreateTextureFromSurface(renderer, s);
+	SDL_FreeSurface(s);
+}
+
+/*
+	push_history() puts url on top of the history, as the page now on screen.
+*/
+static void push_history(const char* url)
+{
+	url_list* l = track_malloc(mem_history, sizeof *l);
+	l->full_url = url;
+	l->next = history;
+	l->snap = NULL;
+	history = l;
+}
+
+/*
+	go_back() starts going back depth pages. The page being returned to is shown as it was left,
+	and the next page load will scroll to where it was. The history stays as it is until that page has loaded,
+	so cancelling the load loses nothing.
+*/
+static void go_back(int depth)
+{
+	const url_list* target = history;
+	for (int i = 0; i < depth && target->next; ++i) target = target->next;
+	current_url = target->full_url;
+	restore_scroll = target->snap ? target->snap->scroll_offset : 0;
+	set_backdrop(target->snap);
+	going_back = depth;
+}
+
+/*
+	pop_history() takes the last depth pages off the history, along with the one they go back to,
+	which is about to be put back on as the page now on screen.
+*/
+static void pop_history(int depth)
+{
+	const url_list* target = history;
+	for (int i = 0; i < depth && target->next; ++i) target = target->next;
+	snapshot* snap = target->snap;
+	for (const url_list* l = history, *next; l != target->next; l = next)
+	{
+		next = l->next;
+		if (l->snap != snap) free_snapshot(l->snap);
+		if (l != target) track_free(mem_history, l);
+	}
+	history = target->next;
+	track_free(mem_history, target);
+	free_snapshot(snap);
+}
+
+/*
+	history_view() shows the previous pages as a grid of thumbnails.
+	It returns how many pages back the clicked one is, or 0 if the view was closed without picking one.
+*/
+static int history_view(void)
+{
+	typedef struct { SDL_Texture* thumb; SDL_Texture* label; int w, h, label_w, label_h; } entry;
+	int count = 0;
+	for (const url_list* l = history ? history->next : NULL; l; l = l->next) ++count;
+	if (!count) return 0;
+	entry* entries = calloc(count, sizeof *entries);
+	int i = 0;
+	for (const url_list* l = history->next; l; l = l->next, ++i)
+	{
+		SDL_Surface* s = snapshot_surface(l->snap);
+		if (s)
+		{
+			int tw = THUMB_WIDTH, th = (long)s->h * THUMB_WIDTH / s->w;
+			if (th > THUMB_HEIGHT) th = THUMB_HEIGHT, tw = (long)s->w * THUMB_HEIGHT / s->h;
+			SDL_Surface* small = box_downscale(s, tw ? tw : 1, th ? th : 1);
+			if (small)
+			{
+				entries[i].thumb = SDL_CreateTextureFromSurface(renderer, small);
+				entries[i].w = small->w;
+				entries[i].h = small->h;
+				SDL_FreeSurface(small);
+			}
+			SDL_FreeSurface(s);
+		}
+		SDL_Surface* label = TTF_RenderUTF8_Blended(menu_font, l->full_url, FGCOLOUR);
+		if (label)
+		{
+			entries[i].label = SDL_CreateTextureFromSurface(renderer, label);
+			entries[i].label_w = label->w;
+			entries[i].label_h = label->h;
+			SDL_FreeSurface(label);
+		}
+	}
+	int picked = 0;
+	for (_Bool open = 1; open;)
+	{
+		const int cell_w = THUMB_WIDTH + 20, cell_h = THUMB_HEIGHT + 40;
+		int columns = (window_width - 20) / cell_w;
+		if (columns < 1) columns = 1;
+		SDL_SetRenderDrawColor(renderer, bg_r, bg_g, bg_b, 255);
+		SDL_RenderClear(renderer);
+		for (i = 0; i < count; ++i)
+		{
+			SDL_Rect cell = {.x = 20 + i % columns * cell_w, .y = BAR_HEIGHT + 10 + i / columns * cell_h, .w = THUMB_WIDTH, .h = THUMB_HEIGHT};
+			if (cell.y > window_height) break;
+			if (entries[i].thumb)
+				draw_texture(entries[i].thumb, (SDL_Rect){.x = cell.x, .y = cell.y, .w = entries[i].w, .h = entries[i].h}, 0);
+			draw_prim_rect(outline_rect, SPCOLOUR, cell);
+			if (entries[i].label)
+			{
+				// Long urls are cut off at the edge of the thumbnail.
+				int w = entries[i].label_w < THUMB_WIDTH ? entries[i].label_w : THUMB_WIDTH;
+				SDL_RenderCopy(renderer, entries[i].label, &(SDL_Rect){.x = 0, .y = 0, .w = w, .h = entries[i].label_h},
+					&(SDL_Rect){.x = cell.x, .y = cell.y + THUMB_HEIGHT + 5, .w = w, .h = entries[i].label_h});
+			}
+		}
+		flush_draws();
+		should_rerender_bar = 1;
+		draw_bar();
+		SDL_RenderPresent(renderer);
+
+		SDL_Event e;
+		next_event(event_history, &e, -1);
+		switch (e.type)
+		{
+			case SDL_QUIT:
+				SDL_PushEvent(&e); // Leave it for the main loop
+				open = 0;
+				break;
+			case SDL_KEYDOWN:
+				if (e.key.keysym.sym == SDLK_ESCAPE || e.key.keysym.sym == SDLK_h) open = 0;
+				break;
+			case SDL_MOUSEBUTTONDOWN:
+				if (e.button.button != SDL_BUTTON_LEFT || e.button.x < 20 || e.button.y < BAR_HEIGHT + 10) break;
+				int column = (e.button.x - 20) / cell_w, row = (e.button.y - BAR_HEIGHT - 10) / cell_h;
+				if (column < columns && row * columns + column < count)
+				{
+					picked = row * columns + column + 1;
+					open = 0;
+				}
 				break;
-			case XML_TEXT_NODE:
+			case SDL_WINDOWEVENT:
+				if (e.window.event == SDL_WINDOWEVENT_RESIZED || e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
 				{
-					char* str = (char*)xmlNodeGetContent(ptr);
-					for (char* ptr = str; *ptr ; ptr++) // Delete all newlines
-						if (*ptr == '\n') *ptr = ' ';
-					if (str[strspn(str, " \r\t")] != '\0') // trick to remove whitespace lines.
-						head = alloc_node(text, str, head);
-					else
-						free(str);
+					window_width = e.window.data1;
+					window_height = e.window.data2;
 				}
 				break;
-			default: err: head = simplify_html(ptr->last, head); break;
 		}
 	}
-	return head;
+	for (i = 0; i < count; ++i)
+	{
+		SDL_DestroyTexture(entries[i].thumb);
+		SDL_DestroyTexture(entries[i].label);
+	}
+	free(entries);
+	should_rerender_bar = 1;
+	return picked;
+}
+
+/*
+	history_log_path() returns the file the history index is kept in, or NULL if there is nowhere to keep it.
+*/
+static char* history_log_path(void)
+{
+	static char dir[PATH_MAX] = "";
+	return user_file_path(dir, "XDG_DATA_HOME", ".local/share", "history.log", 1);
+}
+
+/*
+	put_varint() writes a number seven bits at a time, lowest first, with the top bit set on every byte but the last.
+	It returns how many bytes that took, which is at most five.
+*/
+static size_t put_varint(uint8_t* p, uint32_t v)
+{
+	size_t n = 0;
+	for (; v >= 0x80; v >>= 7) p[n++] = v | 0x80;
+	p[n++] = v;
+	return n;
+}
+
+/*
+	get_varint() reads a number written by put_varint(), moving p past it. It returns 0 if the number runs past end.
+*/
+static _Bool get_varint(const uint8_t** p, const uint8_t* end, uint32_t* v)
+{
+	*v = 0;
+	for (int shift = 0; *p < end && shift < 35; shift += 7)
+	{
+		uint8_t b = *(*p)++;
+		*v |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) return 1;
+	}
+	return 0;
+}
+
+/*
+	next_term() finds the next word in some text and copies it into term, lowercased, returning its length,
+	or 0 once there are no more. Words are runs of letters and digits. The bytes of multibyte UTF-8 characters
+	count as letters, so words in other scripts are kept whole, though only ASCII is lowercased.
+*/
+static size_t next_term(const char** text, const char* end, char* term)
+{
+	const char* s = *text;
+	while (s < end)
+	{
+		if (!isalnum((unsigned char)*s) && !(*s & 0x80))
+		{
+			++s;
+			continue;
+		}
+		const char* start = s;
+		while (s < end && (isalnum((unsigned char)*s) || *s & 0x80)) ++s;
+		size_t len = s - start;
+		if (len < 2 || len > MAX_TERM) continue;
+		for (size_t i = 0; i < len; ++i) term[i] = tolower((unsigned char)start[i]);
+		term[len] = '\0';
+		*text = s;
+		return len;
+	}
+	*text = s;
+	return 0;
+}
+
+/*
+	term_slot() finds where a word is or should go in the history index.
+*/
+static history_term* term_slot(const char* term, size_t len, uint32_t hash)
+{
+	for (uint32_t i = hash;; ++i)
+	{
+		history_term* t = &hindex.terms[i & (hindex.term_cap - 1)];
+		if (!t->term || (t->hash == hash && !strncmp(t->term, term, len) && !t->term[len])) return t;
+	}
+}
+
+/*
+	url_slot() finds where the latest visit to a url is or should go in the history index.
+*/
+static uint32_t* url_slot(const char* url)
+{
+	for (uint32_t i = string_hash(url, strlen(url));; ++i)
+	{
+		uint32_t* slot = &hindex.urls[i & (hindex.url_cap - 1)];
+		if (!*slot || !strcmp(hindex.docs[*slot - 1].url, url)) return slot;
+	}
+}
+
+/*
+	grow_terms() doubles the size of the history index's word table.
+*/
+static void grow_terms(void)
+{
+	history_term* old = hindex.terms;
+	uint32_t old_cap = hindex.term_cap;
+	hindex.term_cap = old_cap ? old_cap * 2 : 4096;
+	hindex.terms = track_calloc(mem_index, hindex.term_cap, sizeof *hindex.terms);
+	for (uint32_t i = 0; i < old_cap; ++i)
+		if (old[i].term) *term_slot(old[i].term, strlen(old[i].term), old[i].hash) = old[i];
+	track_free(mem_index, old);
+}
+
+/*
+	add_history_doc() adds a page to the history index from the body of its record in the log,
+	whether read back at startup or just written. The page's number is added to the postings of each of its words.
+	It returns 0, leaving the index alone, if the record doesn't make sense.
+	Only the indexer calls it, holding hindex.lock.
+*/
+static _Bool add_history_doc(const char* data, uint32_t size, uint32_t visited, uint32_t check, long offset)
+{
+	// Check it all first, so a bad record changes nothing.
+	const uint8_t* end = (const uint8_t*)data + size;
+	const char* url = data;
+	const char* title = memchr(url, '\0', size);
+	if (!title++ || !*url) return 0;
+	const char* after_title = memchr(title, '\0', (const char*)end - title);
+	if (!after_title) return 0;
+	const uint8_t* words = (const uint8_t*)after_title + 1;
+	uint32_t length = 0, tf;
+	for (const uint8_t* p = words; p < end;)
+	{
+		const uint8_t* nul = memchr(p, '\0', end - p);
+		if (!nul || nul == p || nul - p > MAX_TERM) return 0;
+		p = nul + 1;
+		if (!get_varint(&p, end, &tf) || !tf) return 0;
+		length += tf;
+	}
+
+	// Make room for another page, and perhaps another url.
+	if (hindex.doc_count == hindex.doc_cap)
+	{
+		hindex.doc_cap = hindex.doc_cap ? hindex.doc_cap * 2 : 256;
+		hindex.docs = track_realloc(mem_index, hindex.docs, hindex.doc_cap * sizeof *hindex.docs);
+	}
+	if ((hindex.doc_count + 1) * 4 > hindex.url_cap * 3)
+	{
+		track_free(mem_index, hindex.urls);
+		hindex.url_cap = hindex.url_cap ? hindex.url_cap * 2 : 512;
+		hindex.urls = track_calloc(mem_index, hindex.url_cap, sizeof *hindex.urls);
+		for (uint32_t i = 0; i < hindex.doc_count; ++i)
+			if (hindex.docs[i].live) *url_slot(hindex.docs[i].url) = i + 1;
+	}
+
+	// An earlier visit to the same url is still in the postings, but is skipped when searching.
+	uint32_t id = hindex.doc_count;
+	uint32_t* slot = url_slot(url);
+	if (*slot)
+	{
+		history_doc* old = &hindex.docs[*slot - 1];
+		old->live = 0;
+		hindex.live_count--;
+		hindex.live_length -= old->length;
+	}
+	hindex.docs[id] = (history_doc){.url = track_strdup(mem_index, url), .title = *title ? track_strdup(mem_index, title) : NULL,
+		.visited = visited, .check = check, .length = length, .live = 1, .offset = offset};
+	hindex.doc_count++;
+	hindex.live_count++;
+	hindex.live_length += length;
+	*slot = id + 1;
+
+	for (const uint8_t* p = words; p < end;)
+	{
+		const char* term = (const char*)p;
+		size_t len = strlen(term);
+		p += len + 1;
+		get_varint(&p, end, &tf);
+		if ((hindex.term_count + 1) * 4 > hindex.term_cap * 3) grow_terms();
+		uint32_t hash = string_hash(term, len);
+		history_term* t = term_slot(term, len, hash);
+		if (!t->term)
+		{
+			*t = (history_term){.term = track_strdup(mem_index, term), .hash = hash};
+			hindex.term_count++;
+		}
+		if (t->len + 10 > t->cap)
+		{
+			t->cap = t->cap ? t->cap * 2 : 16;
+			t->postings = track_realloc(mem_index, t->postings, t->cap);
+		}
+		t->len += put_varint(t->postings + t->len, id - t->last_doc);
+		t->len += put_varint(t->postings + t->len, tf);
+		t->last_doc = id;
+		t->count++;
+	}
+	return 1;
+}
+
+/*
+	compact_history_log() rewrites the history log with only the latest visit to each url.
+	data is the log as it was read in, which the pages' offsets point into.
+*/
+static void compact_history_log(const char* path, const char* data)
+{
+	char* tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	FILE* f = fopen(tmp, "wb");
+	_Bool ok = f != NULL;
+	for (uint32_t i = 0; ok && i < hindex.doc_count; ++i)
+	{
+		const history_doc* d = &hindex.docs[i];
+		if (!d->live) continue;
+		history_record r;
+		memcpy(&r, data + d->offset, sizeof r);
+		ok = fwrite(data + d->offset, sizeof r + r.size, 1, f) == 1;
+	}
+	if (f && fclose(f)) ok = 0;
+	if (!ok || rename(tmp, path)) remove(tmp);
+	free(tmp);
+}
+
+/*
+	read_history_log() reads the history log into the index, a page at a time so searching can go on meanwhile.
+	Anything after the last good record, like one cut short by a crash, is cut off so new pages follow on from it.
+	If most of the pages have been visited again since, the log is rewritten with just the latest visits.
+*/
+static void read_history_log(const char* path)
+{
+	mapped_file f = map_file(path);
+	const char* data = f.data;
+	size_t at = 0;
+	while (at + sizeof(history_record) <= f.size)
+	{
+		history_record r;
+		memcpy(&r, data + at, sizeof r); // Records follow on from each other, so they aren't aligned
+		const char* body = data + at + sizeof r;
+		if (memcmp(r.magic, "ERHI", 4) || r.size > f.size - at - sizeof r || string_hash(body, r.size) != r.check) break;
+		SDL_LockMutex(hindex.lock);
+		_Bool ok = add_history_doc(body, r.size, r.visited, r.check, at);
+		SDL_UnlockMutex(hindex.lock);
+		if (!ok) break;
+		at += sizeof r + r.size;
+	}
+	if (at < f.size && truncate(path, at)) remove(path);
+	if (hindex.doc_count > HISTORY_COMPACT_MIN && hindex.live_count * 2 < hindex.doc_count) compact_history_log(path, data);
+	unmap_file(f);
+}
+
+/*
+	index_job() counts the words on a visited page, appends the page to the history log, and adds it to the index.
+	A page whose words are the same as on the last visit is left alone. It runs on the indexer thread.
+*/
+static void index_job(const history_job* job)
+{
+	typedef struct { uint32_t offset, len, hash, count; } page_word;
+	buffer record = {0}, words = {0};
+	history_record h = {.magic = "ERHI", .visited = job->visited};
+	const char* title = job->title ? job->title : "";
+	write_to_buffer((char*)&h, sizeof h, 1, &record);
+	write_to_buffer(job->url, 1, strlen(job->url) + 1, &record);
+	write_to_buffer((char*)title, 1, strlen(title) + 1, &record);
+
+	// Count each word. One in the title counts three times, as it says the most about the page.
+	uint32_t cap = 1024, count = 0;
+	page_word* table = track_calloc(mem_index, cap, sizeof *table);
+	char term[MAX_TERM + 1];
+	for (int in_text = 0; in_text < 2; ++in_text)
+	{
+		const char* s = in_text ? job->text : title;
+		const char* end = s + (in_text ? job->len : strlen(title));
+		for (size_t len; (len = next_term(&s, end, term));)
+		{
+			if ((count + 1) * 2 > cap)
+			{
+				page_word* old = table;
+				table = track_calloc(mem_index, cap * 2, sizeof *table);
+				for (uint32_t i = 0; i < cap; ++i)
+				{
+					if (!old[i].len) continue;
+					uint32_t j = old[i].hash;
+					while (table[j & (cap * 2 - 1)].len) ++j;
+					table[j & (cap * 2 - 1)] = old[i];
+				}
+				cap *= 2;
+				track_free(mem_index, old);
+			}
+			uint32_t hash = string_hash(term, len), i = hash;
+			for (; table[i & (cap - 1)].len; ++i)
+			{
+				const page_word* w = &table[i & (cap - 1)];
+				if (w->hash == hash && w->len == len && !memcmp(words.data + w->offset, term, len)) break;
+			}
+			page_word* w = &table[i & (cap - 1)];
+			if (!w->len)
+			{
+				*w = (page_word){.offset = words.len, .len = len, .hash = hash};
+				write_to_buffer(term, 1, len, &words);
+				count++;
+			}
+			w->count += in_text ? 1 : 3;
+		}
+	}
+	for (uint32_t i = 0; i < cap; ++i)
+	{
+		if (!table[i].len) continue;
+		uint8_t n[5];
+		write_to_buffer(words.data + table[i].offset, 1, table[i].len, &record);
+		write_to_buffer("", 1, 1, &record);
+		write_to_buffer((char*)n, 1, put_varint(n, table[i].count), &record);
+	}
+	history_record* r = (history_record*)record.data;
+	r->size = record.len - sizeof *r;
+	r->check = string_hash(record.data + sizeof *r, r->size);
+
+	// Only this thread changes the index, so it can look without the lock.
+	uint32_t* slot = hindex.url_cap ? url_slot(job->url) : NULL;
+	if (count && !(slot && *slot && hindex.docs[*slot - 1].check == r->check))
+	{
+		// A log that can't be written to is given up on, as anything after a bad record would be lost anyway.
+		if (hindex.log && (fwrite(record.data, record.len, 1, hindex.log) != 1 || fflush(hindex.log)))
+		{
+			fclose(hindex.log);
+			hindex.log = NULL;
+		}
+		SDL_LockMutex(hindex.lock);
+		add_history_doc(record.data + sizeof *r, r->size, r->visited, r->check, -1);
+		SDL_UnlockMutex(hindex.lock);
+	}
+	free_buffer(&record);
+	free_buffer(&words);
+	track_free(mem_index, table);
+}
+
+/*
+	free_history_job() frees a page queued for indexing.
+*/
+static void free_history_job(history_job* job)
+{
+	track_free(mem_index, job->url);
+	track_free(mem_index, job->title);
+	track_free(mem_index, job->text);
+	track_free(mem_index, job);
+}
+
+/*
+	history_indexer() is the body of the thread that looks after the history index. It reads the log in, then
+	indexes visited pages as they are queued, until it is told to stop and there is nothing left in the queue.
+*/
+static int history_indexer(void* ptr)
+{
+	(void)ptr;
+	char* path = history_log_path();
+	if (path)
+	{
+		read_history_log(path);
+		hindex.log = fopen(path, "ab");
+		free(path);
+	}
+	SDL_LockMutex(hindex.lock);
+	hindex.ready = 1;
+	for (;;)
+	{
+		while (!hindex.jobs && !hindex.stopping) SDL_CondWait(hindex.wake, hindex.lock);
+		history_job* job = hindex.jobs;
+		if (!job) break;
+		hindex.jobs = job->next;
+		if (!hindex.jobs) hindex.last_job = &hindex.jobs;
+		SDL_UnlockMutex(hindex.lock);
+		index_job(job);
+		free_history_job(job);
+		SDL_LockMutex(hindex.lock);
+	}
+	SDL_UnlockMutex(hindex.lock);
+	if (hindex.log) fclose(hindex.log);
+	hindex.log = NULL;
+	return 0;
 }
 
 /*
-	alloc_node() simply allocates a node in memory, with arguments for the struct fields
+	start_history_index() starts the indexer thread, which begins by reading the history log in.
 */
-const node* alloc_node(node_type type, const void* data, const node* next)
+static void start_history_index(void)
 {
-	node* n = malloc(sizeof(*n));
-	*n = (node){.type = type, .data = data, .next = next};
-	return n;
+	if (!history_indexing) return;
+	hindex.lock = SDL_CreateMutex();
+	hindex.wake = SDL_CreateCond();
+	hindex.last_job = &hindex.jobs;
+	hindex.thread = SDL_CreateThread(history_indexer, "history indexer", NULL);
+	if (!hindex.thread) history_indexing = 0; // Searches just find nothing
 }
 
 /*
-	print_simplified_html() is a debugging function to print a simplified html data structure.
+	stop_history_index() waits for the indexer to finish what is queued, then frees the index.
 */
-void print_simplified_html(const node* ptr)
+static void stop_history_index(void)
 {
-	for (; ptr ; ptr = ptr->next)
+	if (hindex.thread)
 	{
-		switch (ptr->type)
-		{
-			case text          : puts(ptr->text); break;
-			case seperator	    : puts("[SEPERATOR]"); break;
-			case make_bold	    : puts("[BEGIN BOLD]"); break;
-			case remove_bold   : puts("[END BOLD]"); break;
-			case make_italic   : puts("[BEGIN ITALIC]"); break;
-			case remove_italic : puts("[END ITALIC]"); break;
-			case hyperlink     : printf("[HYPERLINK TO %s]\n", ptr->text); break;
-			case end_hyperlink : puts("[END HYPERLINK]"); break;
-			case image         : printf("[IMAGE AT %p]\n", (void*)ptr->image); break;
-			default            : break;
-		}
+		SDL_LockMutex(hindex.lock);
+		hindex.stopping = 1;
+		SDL_CondSignal(hindex.wake);
+		SDL_UnlockMutex(hindex.lock);
+		SDL_WaitThread(hindex.thread, NULL);
+	}
+	for (uint32_t i = 0; i < hindex.doc_count; ++i)
+	{
+		track_free(mem_index, hindex.docs[i].url);
+		track_free(mem_index, hindex.docs[i].title);
+	}
+	for (uint32_t i = 0; i < hindex.term_cap; ++i)
+	{
+		track_free(mem_index, hindex.terms[i].term);
+		track_free(mem_index, hindex.terms[i].postings);
 	}
+	track_free(mem_index, hindex.docs);
+	track_free(mem_index, hindex.terms);
+	track_free(mem_index, hindex.urls);
+	if (hindex.wake) SDL_DestroyCond(hindex.wake);
+	if (hindex.lock) SDL_DestroyMutex(hindex.lock);
+	hindex = (history_index){0};
 }
 
 /*
-	render_simplified_html() renders the simplified html data structure to the screen, including images.
-	It adds hyperlinks and forms to their global lists respectively.
-	It adjusts for scrolling.
+	index_visit() queues the page just loaded to be added to the history index, using its find text.
 */
-void render_simplified_html(const node* ptr)
+static void index_visit(const char* url, const char* title)
 {
-	bool is_seperated = false;
-	int x, y, w, h;
-	const char* url; // hyperlink stuff
-	for (; ptr ; ptr = ptr->next)
+	if (!history_indexing || !finder.len) return;
+	history_job* job = track_malloc(mem_index, sizeof *job);
+	*job = (history_job){.url = track_strdup(mem_index, url), .title = *title ? track_strdup(mem_index, title) : NULL,
+		.text = track_malloc(mem_index, finder.len), .len = finder.len, .visited = time(NULL)};
+	memcpy(job->text, finder.text, finder.len);
+	SDL_LockMutex(hindex.lock);
+	*hindex.last_job = job;
+	hindex.last_job = &job->next;
+	SDL_CondSignal(hindex.wake);
+	SDL_UnlockMutex(hindex.lock);
+}
+
+/*
+	next_posting() moves a cursor on to the next page in a word's postings, returning 0 if there are no more.
+*/
+static _Bool next_posting(history_cursor* c)
+{
+	uint32_t gap;
+	if (c->p == c->end || !get_varint(&c->p, c->end, &gap) || !get_varint(&c->p, c->end, &c->tf)) return 0;
+	c->doc += gap;
+	return 1;
+}
+
+/*
+	search_history() finds the pages in the history index with every word of a query on them, ranked by BM25,
+	and puts the best few in hits, best first. It returns how many it put there, and sets matched to how many
+	pages matched in all. Postings are in page order, so they are walked side by side, led by the rarest word.
+	The caller holds hindex.lock.
+*/
+static size_t search_history(const char* query, history_hit* hits, size_t* matched)
+{
+	history_cursor words[8];
+	size_t word_count = 0, found = 0;
+	char term[MAX_TERM + 1];
+	const char* end = query + strlen(query);
+	*matched = 0;
+	for (size_t len; word_count < 8 && (len = next_term(&query, end, term));)
 	{
-		_Bool render = false;
-		if (plotter_y > -window_height) render = true;
-		if (plotter_y > window_height) return;
-		switch (ptr->type)
+		history_term* t = hindex.term_cap ? term_slot(term, len, string_hash(term, len)) : NULL;
+		if (!t || !t->term) return 0; // Not on any page, so nothing can match
+		_Bool repeated = 0;
+		for (size_t i = 0; i < word_count; ++i) repeated |= words[i].p == t->postings;
+		if (repeated) continue;
+		// Pages since visited again still count towards how common a word is, which hardly matters.
+		float pages = hindex.doc_count, df = t->count;
+		history_cursor c = {.p = t->postings, .end = t->postings + t->len, .count = t->count,
+			.idf = SDL_logf(1 + (pages - df + 0.5f) / (df + 0.5f))};
+		size_t i = word_count++;
+		for (; i > 0 && words[i - 1].count > c.count; --i) words[i] = words[i - 1];
+		words[i] = c;
+	}
+	if (!word_count) return 0;
+	for (size_t i = 0; i < word_count; ++i)
+		if (!next_posting(&words[i])) return 0;
+
+	float average = hindex.live_count ? (float)hindex.live_length / hindex.live_count : 1;
+	do
+	{
+		uint32_t doc = words[0].doc;
+		_Bool everywhere = 1;
+		for (size_t i = 1; i < word_count; ++i)
 		{
-			case text:
-				render_text(ptr->text, renderer, current_font, render);
-				break;
-			case seperator:
-				if (!is_seperated)
-				{
-					plotter_y += TTF_FontHeight(regular_font) + 25;
-					plotter_x = MARGIN_WIDTH;
-					if (render)
-					{
-						SDL_SetRenderDrawColor(renderer, sp_r, sp_g, sp_b, SDL_ALPHA_OPAQUE);
-						SDL_RenderDrawLine(renderer, MARGIN_WIDTH/2, plotter_y, window_width - MARGIN_WIDTH/2, plotter_y);
-					}
-					plotter_y += 25;
-				}
-				break;
-			case make_bold:
-				current_font = bold_font;
-				break;
-			case make_italic:
-				current_font = italic_font;
-				break;
-			case remove_italic:
-			case remove_bold:
-				current_font = regular_font;
-				break;
-			case hyperlink:
-				x = plotter_x;
-				y = plotter_y;
-				url = ptr->text;
-				text_color = HLCOLOUR;
-				break;
-			case end_hyperlink:
-				if (render)
-				{
-					h = TTF_FontHeight(current_font);
-					w = plotter_x - x;
-					if (plotter_y > y)
-					{
-						// Multiline hyperlink
-						add_hyperlink(url, x, y, window_width - MARGIN_WIDTH - x, h);
-						if (plotter_y - h - y > 0) add_hyperlink(url, MARGIN_WIDTH, y + h, window_width - MARGIN_WIDTH, plotter_y - h - y);
-						add_hyperlink(url, MARGIN_WIDTH, plotter_y, plotter_x - MARGIN_WIDTH, h);
-					}
-					else add_hyperlink(url, x, y, w, h);
-				}
-				text_color = FGCOLOUR;
-				break;
-			case image:
-			{
-				if (plotter_x > MARGIN_WIDTH) plotter_y += TTF_FontHeight(current_font) + 10;
-				plotter_x = MARGIN_WIDTH;
-				int image_width = ptr->image->w;
-				int image_height = ptr->image->h;
-				if (image_width > (window_width - MARGIN_WIDTH*2))
-				{
-					image_height *= (window_width - MARGIN_WIDTH*2);
-					image_height /= image_width;
-					image_width = window_width - MARGIN_WIDTH*2;
-				}
-				if (render)
-				{
-					SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, ptr->image);
-					SDL_Rect rect = {MARGIN_WIDTH, plotter_y, image_width, image_height};
-					SDL_RenderCopy(renderer, texture, NULL, &rect);
-					SDL_DestroyTexture(texture);
-				}
-				plotter_y += image_height + 10;
-			}
-			break;
-			case input:
-			{
-				int height = TTF_FontHeight(regular_font);
-				const form* f = ptr->form;
-				form_list* fl = malloc(sizeof *fl);
-				if (plotter_x > MARGIN_WIDTH) plotter_y += height;
-				plotter_x = MARGIN_WIDTH;
-				fl->form = f;
-				fl->next = forms;
-				fl->box.x = MARGIN_WIDTH;
-				fl->box.y = plotter_y + height/2;
-				fl->box.w = CONTENT_WIDTH;
-				fl->box.h = height;
-				plotter_y += height * 2;
-				forms = fl;
-				SDL_SetRenderDrawColor(renderer, fg_r, fg_g, fg_b, SDL_ALPHA_OPAQUE);
-				SDL_RenderDrawRect(renderer, &fl->box);
-			}
-			break;
-			default:
-			break;
+			while (words[i].doc < doc)
+				if (!next_posting(&words[i])) return found;
+			everywhere &= words[i].doc == doc;
 		}
-		if (ptr->type == seperator) is_seperated = true;
-		else is_seperated = false;
+		if (!everywhere || doc >= hindex.doc_count || !hindex.docs[doc].live) continue;
+		const history_doc* d = &hindex.docs[doc];
+		float score = 0;
+		for (size_t i = 0; i < word_count; ++i)
+		{
+			float tf = words[i].tf;
+			score += words[i].idf * tf * 2.2f / (tf + 1.2f * (0.25f + 0.75f * d->length / average));
+		}
+		++*matched;
+		// Keep the best few in order, with later visits winning ties.
+		size_t at = found < HISTORY_RESULTS ? found++ : HISTORY_RESULTS;
+		for (; at > 0 && hits[at - 1].score <= score; --at)
+			if (at < HISTORY_RESULTS) hits[at] = hits[at - 1];
+		if (at < HISTORY_RESULTS) hits[at] = (history_hit){.doc = doc, .score = score};
+	} while (next_posting(&words[0]));
+	return found;
+}
+
+/*
+	history_results() searches the history index and makes a page of the results, linking to each page found.
+*/
+static const node* history_results(const char* query)
+{
+	history_hit hits[HISTORY_RESULTS];
+	size_t matched;
+	Uint64 start = SDL_GetPerformanceCounter();
+	SDL_LockMutex(hindex.lock);
+	size_t count = search_history(query, hits, &matched);
+	const node* n = NULL;
+	for (size_t i = count; i-- > 0;)
+	{
+		const history_doc* d = &hindex.docs[hits[i].doc];
+		char visited[32];
+		time_t t = d->visited;
+		strftime(visited, sizeof visited, "%Y-%m-%d %H:%M", localtime(&t));
+		char* line = track_malloc(mem_text, strlen(d->url) + sizeof visited + 8);
+		sprintf(line, "\n%s, %s\n\n", d->url, visited);
+		n = alloc_node(text, line, n);
+		n = alloc_node(end_hyperlink, NULL, n);
+		n = alloc_node(text, track_strdup(mem_text, d->title ? d->title : d->url), n);
+		n = alloc_node(hyperlink, intern(d->url), n);
 	}
+	char summary[160];
+	snprintf(summary, sizeof summary, "%zu of %u visited pages match, found in %.2f ms%s", matched, hindex.live_count,
+		(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency(),
+		!history_indexing ? " (history isn't being indexed)" : hindex.ready ? "" : " (history is still being read in)");
+	SDL_UnlockMutex(hindex.lock);
+	return
+		alloc_node(make_bold, NULL,
+			alloc_node(text, track_strdup(mem_text, "History search: "),
+				alloc_node(text, track_strdup(mem_text, query),
+					alloc_node(remove_bold, NULL,
+						alloc_node(seperator, NULL,
+							alloc_node(text, track_strdup(mem_text, summary),
+								alloc_node(seperator, NULL, n)))))));
 }
 
+static void draw_note(const char*);
+
 /*
-	init_curl() inits curl innit.
+	draw_status() draws a note under the bar with a strip sliding along the bottom of the bar,
+	to show that something is happening.
 */
-static void init_curl(void)
+static void draw_status(const char* status)
 {
-	curl_global_init(CURL_GLOBAL_ALL);
-	curl_handle = curl_easy_init();
-	curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "Ersatz/0.0.1");
-	//curl_easy_setopt(curl_handle, CURLOPT_PROGRESSFUNCTION, progress_bar);
-	curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 1L);		 // Disable the progress bar
-	curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L); // Follow redirects
+	int width = window_width / 4;
+	int x = (int)(SDL_GetTicks() / 4 % (window_width + width)) - width;
+	draw_prim_rect(fill_rect, HLCOLOUR, (SDL_Rect){.x = x, .y = BAR_HEIGHT - 3, .w = width, .h = 3});
+	draw_note(status);
 }
 
 /*
-	init_sdl() inits sdl innit.
+	draw_note() draws a line of text in a box at the top right of the page.
 */
-static void init_sdl(void)
+static void draw_note(const char* note)
 {
-	if (SDL_Init(SDL_INIT_EVERYTHING)) throw_error("Failed to initialise the SDL window");
-	if (TTF_Init()) throw_error("Failed to initialise SDL_TTF");
-	if (IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG | IMG_INIT_TIF | IMG_INIT_WEBP) == 0) throw_error("Failed to init images");
-	window = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, window_width, window_height, SDL_WINDOW_RESIZABLE);
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+	SDL_Surface* surface = TTF_RenderUTF8_Blended(menu_font, note, FGCOLOUR);
+	if (surface)
+	{
+		SDL_Rect box = {.x = window_width - surface->w - 20, .y = BAR_HEIGHT + 5, .w = surface->w + 10, .h = surface->h + 4};
+		draw_prim_rect(fill_rect, BGCOLOUR, box);
+		draw_prim_rect(outline_rect, SPCOLOUR, box);
+		draw_texture(SDL_CreateTextureFromSurface(renderer, surface),
+			(SDL_Rect){.x = box.x + 5, .y = box.y + 2, .w = surface->w, .h = surface->h}, 1);
+		SDL_FreeSurface(surface);
+	}
+	flush_draws();
 }
 
 /*
-	init_fonts() inits fonts innit.
+	damage_window() makes the next frame draw everything, for when something other than scrolling has changed.
+	It only matters to the CPU renderer, which otherwise redraws as little as it can.
 */
-static void init_fonts(void)
+static void damage_window(void)
 {
-	regular_font = TTF_OpenFont("iosevka-term-regular.ttf", 15);
-	menu_font    = TTF_OpenFont("iosevka-term-regular.ttf", 22);
-	bold_font    = TTF_OpenFont("iosevka-term-bold.ttf", 15);
-	italic_font  = TTF_OpenFont("iosevka-term-italic.ttf", 15);
-	current_font = regular_font;
-	text_color = FGCOLOUR;
+	shown.valid = 0;
 }
 
 /*
-	init_cursors() inits cursors innit.
+	image_load_finished() says whether any image on the page has finished loading and is waiting to be shown.
 */
-static void init_cursors(void)
+static _Bool image_load_finished(void)
 {
-	default_cursor = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_ARROW);
-	loading_cursor = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_WAIT);
+	for (lazy_image* img = page_images; img; img = img->next)
+		if (img->loader && SDL_AtomicGet(&img->state) != image_loading) return 1;
+	return 0;
 }
 
 /*
-	parse_args() initialises colours and the url from commandline arguments.
+	scroll_window() is the CPU renderer's way of scrolling. It moves what is already in the window surface
+	by dy pixels, draws only the strip that scrolled into view, and presents the page area.
 */
-void parse_args(int argc, char** argv)
+static void scroll_window(const node* page, int dy)
 {
-	for (int i = 1 ; i < argc ; ++i)
+	SDL_Surface* s = SDL_GetWindowSurface(window);
+	if (!s)
 	{
-		// I was originally using regular expressions, but sscnf works much better.
-		int success = 0;
-		sscanf(argv[i], "--bg=#%2x%2x%2x%n", &bg_r, &bg_g, &bg_b, &success);
-		sscanf(argv[i], "--fg=#%2x%2x%2x%n", &fg_r, &fg_g, &fg_b, &success);
-		sscanf(argv[i], "--hl=#%2x%2x%2x%n", &hl_r, &hl_g, &hl_b, &success);
-		sscanf(argv[i], "--sp=#%2x%2x%2x%n", &sp_r, &sp_g, &sp_b, &success);
-		// strcmp() return a negative if the second string starts with the first string.
-		if (strcmp("--url=", argv[i]) < 0) current_url = argv[i] + 6, success++;
-		if (!success) throw_error("invalid argument");
+		damage_window();
+		return;
+	}
+	int top = BAR_HEIGHT, bottom = s->h < window_height ? s->h : window_height;
+	int keep = bottom - top - abs(dy);
+	if (keep > 0)
+	{
+		SDL_RenderFlush(renderer);
+		if (SDL_MUSTLOCK(s)) SDL_LockSurface(s);
+		Uint8* rows = s->pixels;
+		if (dy > 0) memmove(rows + (size_t)(top + dy) * s->pitch, rows + (size_t)top * s->pitch, (size_t)keep * s->pitch);
+		else memmove(rows + (size_t)top * s->pitch, rows + (size_t)(top - dy) * s->pitch, (size_t)keep * s->pitch);
+		if (SDL_MUSTLOCK(s)) SDL_UnlockSurface(s);
+	}
+	SDL_Rect strip = dy > 0
+		? (SDL_Rect){.x = 0, .y = top, .w = window_width, .h = dy}
+		: (SDL_Rect){.x = 0, .y = bottom + dy, .w = window_width, .h = -dy};
+	SDL_RenderSetClipRect(renderer, &strip);
+	SDL_SetRenderDrawColor(renderer, bg_r, bg_g, bg_b, 255);
+	SDL_RenderFillRect(renderer, &strip);
+	// The whole page is still laid out, so links, forms and images near the viewport stay up to date.
+	plotter_x = MARGIN_WIDTH;
+	plotter_y = scroll_offset + BAR_HEIGHT;
+	render_simplified_html(page);
+	flush_draws();
+	sweep_images();
+	SDL_RenderSetClipRect(renderer, NULL);
+	SDL_RenderFlush(renderer);
+	SDL_UpdateWindowSurfaceRects(window, &(SDL_Rect){.x = 0, .y = top, .w = window_width, .h = bottom - top}, 1);
+	shown.scroll = scroll_offset;
+}
+
+/*
+	draw_page_frame() draws and presents one frame of a page, or of the backdrop if there is one.
+	If status isn't NULL, it is shown as something going on in the background.
+	The CPU renderer skips frames where nothing changed, and scrolls what it already drew where it can.
+*/
+static void draw_page_frame(const node* page, const char* status)
+{
+	if (memory_dump_requested)
+	{
+		memory_dump_requested = 0;
+		dump_memory(stderr);
+	}
+	Uint64 frame_start = SDL_GetPerformanceCounter();
+	if (cpu_render && !status && !backdrop && !memory_overlay && !should_rerender_bar && shown.valid && shown.page == page
+		&& shown.width == window_width && shown.height == window_height && !image_load_finished())
+	{
+		// Only scrolling can have changed anything.
+		int dy = scroll_offset - shown.scroll;
+		if (!dy)
+		{
+			// Nothing to draw, so wait about a frame for something to happen. A replay has nothing to wait for.
+			if (!replay_file) SDL_WaitEventTimeout(NULL, 16);
+			return;
+		}
+		if (abs(dy) < window_height - BAR_HEIGHT)
+		{
+			scroll_window(page, dy);
+			add_time(&frame_times, &frame_time_count, frame_start);
+			return;
+		}
+	}
+	SDL_SetRenderDrawColor(renderer, bg_r, bg_g, bg_b, 255);
+	SDL_RenderClear(renderer);
+	plotter_x = MARGIN_WIDTH;
+	plotter_y = scroll_offset + BAR_HEIGHT;
+	if (backdrop)
+	{
+		int w, h;
+		SDL_QueryTexture(backdrop, NULL, NULL, &w, &h);
+		SDL_RenderCopy(renderer, backdrop, NULL, &(SDL_Rect){.x = 0, .y = BAR_HEIGHT, .w = w, .h = h});
+	}
+	else
+	{
+		render_simplified_html(page);
+		flush_draws();
+		sweep_images();
+	}
+	draw_bar();
+	if (status) draw_status(status);
+	else if (finder.needle)
+	{
+		char note[128];
+		if (finder.match_count)
+			snprintf(note, sizeof note, "%zu of %zu (F3 next, Esc to stop)", finder.current + 1, finder.match_count);
+		else
+			snprintf(note, sizeof note, "Not found (Esc to stop)");
+		draw_note(note);
+	}
+	if (memory_overlay) draw_memory_overlay();
+	SDL_RenderPresent(renderer);
+	add_time(&frame_times, &frame_time_count, frame_start);
+	// Notes stay put while the page scrolls under them, so a frame with one can't just be scrolled.
+	shown = (shown_frame){.page = page, .scroll = scroll_offset, .width = window_width, .height = window_height,
+		.valid = !status && !backdrop && !memory_overlay && !finder.needle};
+}
+
+/*
+	page_loader() is the body of the thread that fetches and parses a page for load_page_async().
+	Nothing else uses curl_handle meanwhile, so it can have it.
+*/
+static int page_loader(void* ptr)
+{
+	page_load* load = ptr;
+	load->memory = thread_memory;
+	load->loaded = load_page(curl_handle, load->req, load->stats, &page_cancel, &load->page, &load->final_url, load->error);
+	memory_since(&load->memory);
+	SDL_AtomicSet(&load->done, 1);
+	return 0;
+}
+
+/*
+	load_page_async() loads a page on another thread. Meanwhile the window keeps drawing the old page, or the
+	backdrop, with a note saying what is happening. Escape cancels the load, and so does closing the window,
+	whose quit event is put back for the main loop afterwards.
+	It returns what load_page() would, and puts what building the page allocated in memory.
+*/
+static _Bool load_page_async(const request* req, const node* old_page, parsed_page* page, char** final_url, char* error, page_memory* memory)
+{
+	page_load load = {.req = req, .stats = &page_stats};
+	SDL_AtomicSet(&page_cancel.cancelled, 0);
+	page_cancel.watch_input = 0; // We handle events here
+	SDL_Thread* loader = SDL_CreateThread(page_loader, "page loader", &load);
+	if (!loader)
+	{
+		// No thread, so block, and let the fetch watch for Escape itself.
+		page_cancel.watch_input = 1;
+		page_loader(&load);
+	}
+	const char* status = req->method == post ? "Sending form (Esc to cancel)" : "Loading (Esc to cancel)";
+	_Bool quit = 0;
+	while (loader && !SDL_AtomicGet(&load.done))
+	{
+		draw_page_frame(old_page, status);
+		SDL_Event e;
+		if (!next_event(event_load, &e, 30)) continue;
+		switch (e.type)
+		{
+			case SDL_QUIT:
+				quit = 1;
+				SDL_AtomicSet(&page_cancel.cancelled, 1);
+				break;
+			case SDL_KEYDOWN:
+				if (e.key.keysym.sym == SDLK_ESCAPE) SDL_AtomicSet(&page_cancel.cancelled, 1);
+				break;
+			case SDL_RENDER_TARGETS_RESET:
+			case SDL_RENDER_DEVICE_RESET:
+				should_rerender_bar = 1;
+				break;
+			case SDL_WINDOWEVENT:
+				if (e.window.event == SDL_WINDOWEVENT_RESIZED || e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+				{
+					window_width = e.window.data1;
+					window_height = e.window.data2;
+					should_rerender_bar = 1;
+				}
+				break;
+		}
 	}
+	if (loader) SDL_WaitThread(loader, NULL);
+	if (quit) SDL_PushEvent(&(SDL_Event){.type = SDL_QUIT});
+	*final_url = load.final_url;
+	memcpy(error, load.error, CURL_ERROR_SIZE);
+	*page = load.page;
+	*memory = load.memory;
+	return load.loaded;
 }
 
 /*
@@ -763,75 +5561,146 @@ void parse_args(int argc, char** argv)
 */
 int main(int argc, char** argv)
 {
+	startup_time = SDL_GetPerformanceCounter();
 	bind_error_signals();
+	signal(SIGUSR1, request_memory_dump);
+	parse_args(argc, argv); // Before anything else, so colours and tracing apply from the start
 	init_curl();
+	if (bench_file) return run_bench();
+	if (cache_check) return run_cache_check();
+	if (headless) return run_headless();
+	start_session();
 	init_sdl();
 	init_fonts();
 	init_cursors();
-
-	parse_args(argc, argv);
+	start_history_index();
 
 	if (!current_url)
 	{
-		enter_url:
-		current_url = text_input("Enter URL");
+		enter_url:;
+		const char* entered = text_input("Enter URL, or ? and some words to search history");
+		current_url = intern(entered);
+		free((void*)entered);
 	}
 
 new_page:;
 	start_loading();
+	Uint64 load_start = SDL_GetPerformanceCounter();
+
+	// A form submission brings its own request. Anything else is a plain GET of current_url.
+	static request* submission = NULL;
+	request plain = {.url = current_url, .method = get};
+	const request* req = submission ? submission : &plain;
+
+	// The old page stays up until the new one is ready.
+	static const node* simple = NULL;
+	parsed_page page = {0};
+	_Bool loaded = 0;
+	char* final_url = NULL;
+	char load_error[CURL_ERROR_SIZE];
+	cached_page next_cached = {0};
+	lazy_image* old_images = page_images;
+	page_images = NULL;
+	page_memory new_memory = thread_memory;
+	// Form submissions are never cached.
+	_Bool from_history = !submission && req->url[0] == '?';
+	_Bool from_cache = !from_history && !submission && open_cached_page(req->url, &next_cached);
+	memory_since(&new_memory);
+	lazy_image* new_images = page_images;
+	page_images = old_images;
+	if (!from_cache && !from_history)
+	{
+		loaded = load_page_async(req, simple, &page, &final_url, load_error, &new_memory);
+		new_images = loaded ? page.images : NULL;
+		if (!loaded && simple && SDL_AtomicGet(&page_cancel.cancelled))
+		{
+			// Cancelled, so stay on the page we were on, with the history as it was.
+			set_backdrop(NULL);
+			free_request(submission);
+			submission = NULL;
+			free(final_url);
+			current_url = page_url;
+			restore_scroll = 0;
+			going_back = 0;
+			stop_loading();
+			goto show_page;
+		}
+	}
+	set_backdrop(NULL);
+	_Bool cacheable = loaded && !submission;
+	free_request(submission);
+	submission = NULL;
+	req = NULL;
 
 	dealloc_forms(forms);
 	forms = NULL;
-
 	dealloc_links(hyperlinks);
 	hyperlinks = NULL;
+	free_page(simple);
+	page_images = new_images;
+	check_page_memory(&new_memory);
 
-	FILE* html = url_to_file(current_url);
-
+	if (from_cache)
 	{
-		char* buf;
-		curl_easy_getinfo(curl_handle, CURLINFO_EFFECTIVE_URL, &buf);
-		current_url = strdup(buf);
+		// Straight from disk to layout
+		current_cached = next_cached;
+		simple = current_cached.nodes;
+		current_url = current_cached.final_url;
+		window_title = current_cached.title ? current_cached.title : "";
+		page_stats = (fetch_stats){0};
 	}
+	else if (from_history)
+	{
+		// A search of the history index, answered without going anywhere
+		simple = history_results(current_url + 1);
+		window_title = "History search";
+		page_stats = (fetch_stats){0};
+	}
+	else
+	{
+		current_url = intern(final_url);
+		free(final_url);
 
-	htmlDocPtr doc = parse_html_file(html, current_url);
-
-	fclose(html);
-	xmlCleanupParser();
+		xmlCleanupParser();
 
-	static const node* simple = NULL;
-	dealloc_nodes(simple);
-	simple = simplify_html(doc->last, NULL);
+		// The page was built as it was parsed, so all that is left is to take it.
+		simple = loaded ? page.nodes : error_page(current_url, load_error);
+		page_strings = page.strings;
+		window_title = !loaded ? "Error" : page.title ? page.title : "";
+		if (cacheable)
+		{
+			save_cached_page(plain.url, current_url, simple, window_title, page.cache_for);
+			check_cached_page(plain.url, current_url, simple, window_title);
+		}
+	}
+	page_url = current_url;
+	build_find_index(simple);
+	if (loaded || from_cache) index_visit(current_url, window_title);
 
-	//print_simplified_html(simple);
+	//print_simplified_html(simple, stdout);
 
-	scroll_offset = 0;
+	scroll_offset = restore_scroll;
+	restore_scroll = 0;
 
 	SDL_SetWindowTitle(window, window_title);
 
-	{
-		url_list* l = malloc(sizeof *l);
-		l->full_url = current_url;
-		l->next = history;
-		history = l;
-	}
+	if (going_back) pop_history(going_back);
+	going_back = 0;
+	push_history(current_url);
+	stop_loading();
+	add_time(&load_times, &load_time_count, load_start);
 
+show_page:
 	should_rerender_bar = 1;
-
-	stop_loading();
+	damage_window();
 
 	SDL_Event e;
 	do {
-		SDL_SetRenderDrawColor(renderer, bg_r, bg_g, bg_b, 255);
-		SDL_RenderClear(renderer);
-		render_simplified_html(simple);
-		draw_bar();
-		SDL_RenderPresent(renderer);
-
-		plotter_x = MARGIN_WIDTH;
-		plotter_y = scroll_offset + BAR_HEIGHT;
+		draw_page_frame(simple, NULL);
+		static _Bool painted = 0;
+		if (!painted) trace_startup("first paint"), painted = 1;
 
-		SDL_PollEvent(&e);
+		_Bool fresh = next_event(event_main, &e, 0); // If there was no event, e is still the last one
 		switch (e.type)
 		{
 			case SDL_KEYDOWN:
@@ -847,15 +5716,53 @@ new_page:;
 go_back:
 						if (history->next)
 						{
-							current_url = history->next->full_url;
-							const url_list* n = history->next->next;
-							free((void*)history->full_url);
-							free((void*)history->next);
-							free((void*)history);
-							history = n;
-							xmlFreeDoc(doc);
+							go_back(1);
 							goto new_page;
 						}
+						break;
+					case SDLK_F12:
+						if (!fresh) break; // Otherwise it would toggle every frame until the next event
+						memory_overlay = !memory_overlay;
+						damage_window();
+						break;
+					case SDLK_f:
+						if (fresh && e.key.keysym.mod & KMOD_CTRL)
+						{
+							char* str = (char*)text_input("Find in page");
+							start_find(str);
+							free(str);
+							jump_to_match(simple);
+							damage_window();
+						}
+						break;
+					case SDLK_F3:
+					case SDLK_RETURN:
+						// Next match, or the one before with shift, once per key press
+						if (!fresh || !finder.match_count) break;
+						if (e.key.keysym.mod & KMOD_SHIFT)
+							finder.current = (finder.current + finder.match_count - 1) % finder.match_count;
+						else
+							finder.current = (finder.current + 1) % finder.match_count;
+						jump_to_match(simple);
+						damage_window();
+						break;
+					case SDLK_ESCAPE:
+						if (!fresh || !finder.needle) break;
+						clear_find();
+						damage_window();
+						break;
+					case SDLK_h:
+						if (fresh && e.key.keysym.mod & KMOD_CTRL)
+						{
+							int depth = history_view();
+							damage_window();
+							if (depth)
+							{
+								go_back(depth);
+								goto new_page;
+							}
+						}
+						break;
 				}
 				break;
 			case SDL_MOUSEBUTTONDOWN:
@@ -867,34 +5774,26 @@ go_back:
 						goto go_back;
 					if (does_intersect_rect(x, y, URL_RECT))
 					{
-						xmlFreeDoc(doc);
+						leave_page(simple);
 						goto enter_url;
 					}
 					for (const form_list* l = forms; l; l = l->next)
 					{
 						if (does_intersect_rect(x, y, l->box))
 						{
-							// Time to make a request.
-							static char buf[1024] = "";
-							const form* f = l->form;
-							const char* url = add_urls(current_url, f->action);
-							const char* inp = text_input(url);
-							char* inp_esc = curl_easy_escape(curl_handle, inp, strlen(inp));
-							if (f->method == post)
-							{
-								sprintf(buf, "%s=%s", f->name, inp_esc);
-								curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, buf);
-							}
-							else
+							form_field* field = l->field;
+							if (field->kind != submit_field)
 							{
-								sprintf(buf, "%s?%s=%s", url, f->name, inp_esc);
-								free((void*)url);
-								url = strdup(buf);
+								const char* entered = text_input(field->name ? field->name : resolve_url(&page_strings, current_url, field->form->action));
+								track_free(mem_text, field->entered);
+								field->entered = tracked(mem_text, (char*)entered);
+								damage_window();
+								if (!submits_on_enter(field)) break;
 							}
-							current_url = url;
-							free((void*)inp);
-							curl_free(inp_esc);
-							xmlFreeDoc(doc);
+							// Time to make a request.
+							submission = build_request(field->form, field, current_url);
+							current_url = submission->url;
+							leave_page(simple);
 							goto new_page;
 						}
 					}
@@ -904,14 +5803,24 @@ go_back:
 						if (does_intersect_rect(x, y, h.box))
 						{
 							// Clicked!
-							current_url = add_urls(current_url, h.url);
-							xmlFreeDoc(doc);
+							current_url = intern(resolve_url(&page_strings, current_url, h.url));
+							leave_page(simple);
 							goto new_page;
 						}
 					}
 				}
 				break;
+			case SDL_RENDER_TARGETS_RESET:
+			case SDL_RENDER_DEVICE_RESET:
+				// The cached bar texture has lost its contents.
+				if (!fresh) break;
+				should_rerender_bar = 1;
+				damage_window();
+				break;
 			case SDL_WINDOWEVENT:
+				if (!fresh) break;
+				// Exposure and the like can spoil the window surface, so anything to do with the window redraws it.
+				damage_window();
 				if (e.window.event == SDL_WINDOWEVENT_RESIZED || e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
 				{
 					window_width = e.window.data1;
@@ -923,20 +5832,27 @@ go_back:
 	} while (e.type != SDL_QUIT);
 
 	// Cleanup
-	dealloc_nodes(simple);
+	stop_history_index();
+	free_page(simple);
 	dealloc_forms(forms);
 	dealloc_links(hyperlinks);
-	xmlFreeDoc(doc);
 	TTF_CloseFont(regular_font);
+	TTF_CloseFont(menu_font);
 	TTF_CloseFont(bold_font);
 	TTF_CloseFont(italic_font);
+	close_fallback_fonts();
 	TTF_Quit();
+	unmap_file(regular_font_file);
+	unmap_file(bold_font_file);
+	unmap_file(italic_font_file);
+	IMG_Quit();
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	SDL_FreeCursor(default_cursor);
 	SDL_FreeCursor(loading_cursor);
 	SDL_Quit();
 	curl_easy_cleanup(curl_handle);
+	end_session();
 	//print_tag_hashes();
 	return EXIT_SUCCESS;
 }
@@ -944,30 +5860,37 @@ go_back:
 /*
 	dealloc_nodes() deallocates a list of nodes.
 	It also tries to deallocate their contents.
+	It goes round a loop rather than recursing, as a long page can have more nodes than the stack has room for.
 */
 void dealloc_nodes(const node* n)
 {
-	if (n)
+	for (const node* next; n; n = next)
 	{
-		dealloc_nodes(n->next);
+		next = n->next;
 		switch (n->type)
 		{
+			case form_start:
+				// The action is in the page's strings, and the fields belong to their own nodes.
+				track_free(mem_nodes, n->form);
+				break;
 			case input:
-				free((void*)n->form->name);
-				free((void*)n->form->action);
-				free((void*)n->form);
+				track_free(mem_text, n->field->value);
+				track_free(mem_text, n->field->entered);
+				track_free(mem_nodes, n->field);
 				break;
 			case image:
-				SDL_FreeSurface(n->image);
+				SDL_AtomicSet(&n->image->cancel.cancelled, 1);
+				if (n->image->loader) finish_image_load(n->image);
+				free_levels(n->image);
+				track_free(mem_images, n->image);
 				break;
 			case text:
-			case hyperlink:
-				free((void*)n->text);
+				track_free(mem_text, n->text);
 				break;
 			default:
 				break;
 		}
-		free((void*)n);
+		track_free(mem_nodes, n);
 	}
 }
 
@@ -1020,7 +5943,8 @@ unsigned int insensitive_hash(const char *str)
 
 /*
 	draw_bar() draws the bar at the top of the screen, with the current url and a back button.
-	It uses the should_rerender_bar variable - which is set if the entire bar needs to be redrawn
+	It uses the should_rerender_bar variable - which is set if the entire bar needs to be redrawn.
+	Where the renderer supports it, the bar is drawn once into a texture and that is reused until it changes.
 */
 void draw_bar()
 {
@@ -1029,7 +5953,9 @@ void draw_bar()
 	static int back_text_height;
 	static SDL_Texture* t1 = NULL;
 	static SDL_Texture* t2 = NULL;
+	static SDL_Texture* bar_texture = NULL;
 	const char* back_button_text = " back ";
+	const SDL_Rect bar_rect = ((SDL_Rect){.x = 0, .y = 0, .w = window_width, .h = BAR_HEIGHT});
 	if (should_rerender_bar)
 	{
 		// These things only need initialising when the window is resized.
@@ -1047,24 +5973,38 @@ void draw_bar()
 		t2 = SDL_CreateTextureFromSurface(renderer, s2);
 		SDL_FreeSurface(s1);
 		SDL_FreeSurface(s2);
+		SDL_DestroyTexture(bar_texture);
+		bar_texture = NULL;
+		if (SDL_RenderTargetSupported(renderer))
+			bar_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, window_width, BAR_HEIGHT);
+		if (bar_texture) SDL_SetRenderTarget(renderer, bar_texture);
+	}
+	else if (bar_texture)
+	{
+		// Nothing has changed, so the cached bar is still good.
+		SDL_RenderCopy(renderer, bar_texture, NULL, &bar_rect);
+		return;
 	}
 
 	const SDL_Rect back_rect = BACK_RECT;
 	const SDL_Rect url_rect = URL_RECT;
 
-	const SDL_Rect bar_rect				= ((SDL_Rect){.x = 0, .y = 0, .w = window_width, .h = 50});
 	const SDL_Rect back_text_rect = (SDL_Rect){.x = window_width - 90, .y = 10, .w = back_text_width, .h = back_text_height};
 	const SDL_Rect url_text_rect	= ((SDL_Rect){.x = 15, .y = 15, .w = url_width, .h = 20});
 
-	// This is the actually drawing to the screen bit.
-	SDL_SetRenderDrawColor(renderer, bg_r, bg_g, bg_b, 255);
-	SDL_RenderFillRect(renderer, &bar_rect);
-	SDL_SetRenderDrawColor(renderer, sp_r, sp_g, sp_b, 255);
-	SDL_RenderDrawRect(renderer, &bar_rect);
-	SDL_RenderDrawRect(renderer, &back_rect);
-	SDL_RenderDrawRect(renderer, &url_rect);
-	SDL_RenderCopy(renderer, t1, NULL, &back_text_rect);
-	SDL_RenderCopy(renderer, t2, NULL, &url_text_rect);
+	// This is the actually drawing bit - into the bar texture if we have one, otherwise to the screen.
+	draw_prim_rect(fill_rect, BGCOLOUR, bar_rect);
+	draw_prim_rect(outline_rect, SPCOLOUR, bar_rect);
+	draw_prim_rect(outline_rect, SPCOLOUR, back_rect);
+	draw_prim_rect(outline_rect, SPCOLOUR, url_rect);
+	draw_texture(t1, back_text_rect, 0);
+	draw_texture(t2, url_text_rect, 0);
+	flush_draws();
+	if (bar_texture)
+	{
+		SDL_SetRenderTarget(renderer, NULL);
+		SDL_RenderCopy(renderer, bar_texture, NULL, &bar_rect);
+	}
 }
 
 /*
@@ -1105,7 +6045,7 @@ const char* text_input(const char* prompt)
 		SDL_RenderPresent(input_renderer);
 		SDL_DestroyTexture(input_texture);
 		SDL_FreeSurface(input_surface);
-		SDL_WaitEvent(&e);
+		next_event(event_prompt, &e, -1);
 		// Here we handle input.
 		switch (e.type)
 		{